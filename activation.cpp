@@ -0,0 +1,148 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "activation.h"
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <sys/epoll.h>
+#include <sys/fsuid.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "loop.h"
+
+namespace {
+
+struct user_sockets {
+    activation_sockets sockets;
+    activation_callback on_connection;
+    bool connected = false; // No longer listened on, awaiting activation_take
+};
+
+std::map<int, user_sockets> users; // Keyed by UID
+
+void close_sockets(const user_sockets& user) {
+    for (int fd : user.sockets.fds) {
+        if (!user.connected) {
+            loop_remove(fd);
+        }
+        close(fd);
+    }
+}
+
+void handle_connection(int uid) {
+    auto it = users.find(uid);
+    if (it == users.end() || it->second.connected) {
+        return;
+    }
+    for (int fd : it->second.sockets.fds) {
+        loop_remove(fd);
+    }
+    it->second.connected = true;
+    log_info(uid) << "One of their sockets was connected to, spawning their dinit";
+    it->second.on_connection(uid);
+}
+
+// Bound with the user's filesystem credentials, so that the socket is theirs, and only what they could create
+// themselves can be created, whatever they have placed in their runtime directory
+int create_socket(const user_entry& user, const std::filesystem::path& path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.string().size() >= sizeof(address.sun_path)) {
+        log_error(user.uid) << path.string() << " is too long for a socket path";
+        return -1;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    // Left blocking, as it is for whatever ends up accepting on it, never us
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        log_error(user.uid) << "Failed to create a socket: " << std::strerror(errno);
+        return -1;
+    }
+    uid_t daemon_uid = geteuid();
+    gid_t daemon_gid = getegid();
+    setfsgid(user.gid);
+    setfsuid(user.uid);
+    bool as_user = (uid_t)setfsuid(-1) == user.uid && (gid_t)setfsgid(-1) == user.gid;
+    int result = -1;
+    if (as_user) {
+        unlink(path.c_str()); // Left over from an earlier session
+        result = bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    }
+    int saved_errno = errno;
+    setfsuid(daemon_uid);
+    setfsgid(daemon_gid);
+
+    if (!as_user) {
+        log_error(user.uid) << "Failed to take on their filesystem credentials!";
+    } else if (result == -1) {
+        log_error(user.uid) << "Failed to bind " << path.string() << ": " << std::strerror(saved_errno);
+    } else if (listen(fd, SOMAXCONN) == -1) {
+        log_error(user.uid) << "Failed to listen on " << path.string() << ": " << std::strerror(errno);
+    } else {
+        return fd;
+    }
+    close(fd);
+    return -1;
+}
+
+} // namespace
+
+bool activation_listen(const user_entry& user, const std::filesystem::path& runtime_dir,
+    const std::vector<std::string>& names, activation_callback on_connection) {
+    int uid = user.uid;
+    activation_cancel(uid);
+
+    user_sockets created;
+    created.on_connection = std::move(on_connection);
+    for (const std::string& name : names) {
+        int fd = create_socket(user, runtime_dir / name);
+        if (fd == -1) {
+            close_sockets(created);
+            return false;
+        }
+        created.sockets.fds.push_back(fd);
+        created.sockets.names.push_back(name);
+        loop_add(fd, EPOLLIN, [uid](uint32_t) { handle_connection(uid); });
+    }
+    users.insert({uid, std::move(created)});
+    log_info(uid) << "Listening on " << names.size() << " sockets, spawning their dinit on the first connection";
+    return true;
+}
+
+bool activation_waiting(int uid) {
+    auto it = users.find(uid);
+    return it != users.end() && !it->second.connected;
+}
+
+std::optional<activation_sockets> activation_take(int uid) {
+    auto it = users.find(uid);
+    if (it == users.end() || !it->second.connected) {
+        return std::nullopt;
+    }
+    activation_sockets sockets = std::move(it->second.sockets);
+    users.erase(it);
+    return sockets;
+}
+
+void activation_cancel(int uid) {
+    auto it = users.find(uid);
+    if (it == users.end()) {
+        return;
+    }
+    close_sockets(it->second);
+    users.erase(it);
+}
+
+std::vector<int> activation_waiting_uids() {
+    std::vector<int> uids;
+    for (const auto& [uid, user] : users) {
+        if (!user.connected) {
+            uids.push_back(uid);
+        }
+    }
+    return uids;
+}
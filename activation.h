@@ -0,0 +1,32 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+#include "passwd_cache.h"
+
+// Lazy sessions get no dinit at login. Instead the sockets they name are created, as the user, in their runtime
+// directory and listened on here, and the first connection to any of them is what spawns their dinit. The sockets are
+// then handed over to it with the connection still waiting to be accepted, so nothing the client sent is lost.
+
+// Called from the event loop on the first connection to one of a user's sockets, which are no longer listened on
+using activation_callback = std::function<void(int uid)>;
+
+bool activation_listen(const user_entry& user, const std::filesystem::path& runtime_dir,
+    const std::vector<std::string>& names, activation_callback on_connection);
+// Listening, and not yet connected to
+bool activation_waiting(int uid);
+
+struct activation_sockets {
+    std::vector<int> fds;
+    std::vector<std::string> names;
+};
+
+// Gives up the sockets of a user whose socket was connected to, for passing to their dinit. The caller closes them.
+std::optional<activation_sockets> activation_take(int uid);
+// Closes the sockets of a user who logged out without needing their dinit
+void activation_cancel(int uid);
+std::vector<int> activation_waiting_uids();
@@ -0,0 +1,346 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+// Simulates a login storm against a real dinit-user-spawn. A number of users log in and out at the same time, over and
+// over, as mkdir and rmdir in a scratch monitored path, with stub_dinit as their dinit. The users are made up, through
+// --passwd-file, with their homes in the scratch directory too. Reports the latency from each mkdir to the stub being
+// exec'd, and from each rmdir to the stub having exited.
+//
+// It needs root, to spawn as other users, and exits with 77 without it, which meson treats as a skipped test.
+
+#include <algorithm>
+#include <barrier>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+const int skipped_exit_code = 77;
+
+struct bench_options {
+    std::filesystem::path daemon;
+    std::filesystem::path stub;
+    std::filesystem::path scratch_parent = "/tmp"; // A tmpfs on most systems
+    int users = 8;
+    int cycles = 20;
+    int first_uid = 61000;
+    bool spawn_helper = false;
+    std::chrono::milliseconds timeout{5000}; // For each spawn or teardown, after which it counts as failed
+};
+
+struct results {
+    std::mutex mutex;
+    std::vector<int64_t> spawn_ns;
+    std::vector<int64_t> teardown_ns;
+    int failures = 0;
+};
+
+// The stub records its exec time from the same clock
+int64_t monotonic_ns() {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Not a pidfd_open wrapper in every libc yet
+int pidfd_open(pid_t pid, unsigned int flags) {
+    return (int)syscall(SYS_pidfd_open, pid, flags);
+}
+
+void print_usage(const char* program) {
+    std::cout << "Usage: " << program << " --daemon <path> --stub <path> [options]\n"
+        << "  --users <count>   Users logging in and out at the same time (default: 8)\n"
+        << "  --cycles <count>  Logins and logouts for each of them (default: 20)\n"
+        << "  --first-uid <uid> UIDs are made up from here onwards (default: 61000)\n"
+        << "  --scratch-dir <path>\n"
+        << "                    Where the scratch directory is created, which should be a tmpfs (default: /tmp)\n"
+        << "  --spawn-helper    Pass --spawn-helper on to the daemon\n"
+        << "  --timeout-ms <ms> How long a spawn or teardown may take before it counts as failed (default: 5000)" << std::endl;
+}
+
+bool parse_bench_options(int argc, char** argv, bench_options& bench) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--spawn-helper") {
+            bench.spawn_helper = true;
+        } else if (arg == "--daemon" && has_value) {
+            bench.daemon = argv[++i];
+        } else if (arg == "--stub" && has_value) {
+            bench.stub = argv[++i];
+        } else if (arg == "--scratch-dir" && has_value) {
+            bench.scratch_parent = argv[++i];
+        } else if ((arg == "--users" || arg == "--cycles" || arg == "--first-uid" || arg == "--timeout-ms") && has_value) {
+            int value = atoi(argv[++i]);
+            if (value <= 0) {
+                std::cerr << arg << " must be a positive number" << std::endl;
+                return false;
+            }
+            if (arg == "--users") bench.users = value;
+            else if (arg == "--cycles") bench.cycles = value;
+            else if (arg == "--first-uid") bench.first_uid = value;
+            else bench.timeout = std::chrono::milliseconds(value);
+        } else {
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    if (bench.daemon.empty() || bench.stub.empty()) {
+        print_usage(argv[0]);
+        return false;
+    }
+    return true;
+}
+
+bool write_file(const std::filesystem::path& path, const std::string& content) {
+    std::ofstream out(path, std::ios::trunc);
+    out << content;
+    out.close();
+    if (!out) {
+        std::cerr << "Failed to write " << path.string() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Lays out the scratch directory:
+//   run/         the monitored path
+//   exec/        where the stubs record their exec time, writable by every user
+//   home/<uid>/  each user's home, with a toml pointing their dinit at the stub
+//   stub-dinit   a copy of the stub, so it can be exec'd as the users whatever the build directory's permissions
+//   passwd       the made up users, for --passwd-file
+std::optional<std::filesystem::path> create_scratch(const bench_options& bench) {
+    std::string pattern = (bench.scratch_parent / "dinit-user-spawn-bench.XXXXXX").string();
+    if (mkdtemp(pattern.data()) == nullptr) {
+        std::cerr << "Failed to create a scratch directory in " << bench.scratch_parent.string() << ": " << std::strerror(errno) << std::endl;
+        return std::nullopt;
+    }
+    std::filesystem::path scratch = pattern;
+    std::string passwd;
+    try {
+        std::filesystem::permissions(scratch, std::filesystem::perms(0755));
+        std::filesystem::create_directory(scratch / "run");
+        std::filesystem::create_directory(scratch / "exec");
+        std::filesystem::permissions(scratch / "exec", std::filesystem::perms(01777));
+        std::filesystem::copy_file(bench.stub, scratch / "stub-dinit");
+        std::filesystem::permissions(scratch / "stub-dinit", std::filesystem::perms(0755));
+        for (int uid = bench.first_uid; uid < bench.first_uid + bench.users; uid++) {
+            std::filesystem::path home = scratch / "home" / std::to_string(uid);
+            std::filesystem::path dinitd = home / ".config/dinit.d";
+            std::filesystem::create_directories(dinitd / "boot.d");
+            std::filesystem::create_directories(dinitd / "config");
+            if (!write_file(dinitd / "boot", "type = internal\n")
+                || !write_file(dinitd / "config/dinit-user-spawn.toml", "binary = \"" + (scratch / "stub-dinit").string()
+                    + "\"\ndinit_arguments = [\"" + (scratch / "exec").string() + "\"]\n")) {
+                return std::nullopt;
+            }
+            passwd += "bench" + std::to_string(uid) + ":x:" + std::to_string(uid) + ":" + std::to_string(uid) + "::"
+                + home.string() + ":/bin/sh\n";
+        }
+    } catch (const std::filesystem::filesystem_error& e) {
+        std::cerr << "Failed to lay out " << scratch.string() << ": " << e.what() << std::endl;
+        return std::nullopt;
+    }
+    if (!write_file(scratch / "passwd", passwd)) {
+        return std::nullopt;
+    }
+    return scratch;
+}
+
+// Started with its output in daemon.log, which is also how we know it is watching the monitored path
+pid_t start_daemon(const bench_options& bench, const std::filesystem::path& scratch) {
+    std::filesystem::path log_path = scratch / "daemon.log";
+    std::vector<std::string> arguments = {bench.daemon.string(), "--monitored-path", (scratch / "run").string(),
+        "--passwd-file", (scratch / "passwd").string(), "--no-control-socket", "--no-state-file"};
+    if (bench.spawn_helper) {
+        arguments.push_back("--spawn-helper");
+    }
+    std::vector<char*> argv;
+    for (std::string& argument : arguments) {
+        argv.push_back(argument.data());
+    }
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int log_fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (log_fd == -1 || dup2(log_fd, STDOUT_FILENO) == -1 || dup2(log_fd, STDERR_FILENO) == -1) {
+            _exit(EXIT_FAILURE);
+        }
+        execv(argv[0], argv.data());
+        _exit(EXIT_FAILURE);
+    }
+    if (pid == -1) {
+        std::cerr << "Failed to fork: " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + bench.timeout;
+    while (std::chrono::steady_clock::now() < deadline) {
+        std::ifstream log(log_path);
+        std::string line;
+        while (std::getline(log, line)) {
+            if (line.find("Monitoring directory") != std::string::npos) {
+                return pid;
+            }
+        }
+        if (waitpid(pid, nullptr, WNOHANG) == pid) {
+            std::cerr << "The daemon exited straight away, see " << log_path.string() << std::endl;
+            return -1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    std::cerr << "The daemon did not start watching in time, see " << log_path.string() << std::endl;
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    return -1;
+}
+
+// inotify_fd watches the exec directory, which the stub renames its record into. Any rename there is a reason to look
+// again, and as the time itself comes from the stub, noticing late does not skew it.
+std::optional<std::pair<int64_t, pid_t>> wait_for_exec(int inotify_fd, const std::filesystem::path& path, int64_t deadline_ns) {
+    while (true) {
+        std::ifstream in(path);
+        long long exec_ns;
+        int pid;
+        if (in >> exec_ns >> pid) {
+            return std::pair<int64_t, pid_t> {exec_ns, pid};
+        }
+        int64_t remaining_ns = deadline_ns - monotonic_ns();
+        if (remaining_ns <= 0) {
+            return std::nullopt;
+        }
+        pollfd renamed = {inotify_fd, POLLIN, 0};
+        if (poll(&renamed, 1, (int)(remaining_ns / 1000000) + 1) == 1) {
+            alignas(inotify_event) char buffer[4096];
+            while (read(inotify_fd, buffer, sizeof(buffer)) > 0) {}
+        }
+    }
+}
+
+void run_user(const bench_options& bench, const std::filesystem::path& scratch, int uid, std::barrier<>& start, results& out) {
+    std::filesystem::path runtime_dir = scratch / "run" / std::to_string(uid);
+    std::filesystem::path exec_file = scratch / "exec" / std::to_string(uid);
+    int64_t timeout_ns = std::chrono::nanoseconds(bench.timeout).count();
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1 || inotify_add_watch(inotify_fd, (scratch / "exec").c_str(), IN_MOVED_TO) == -1) {
+        std::cerr << "Failed to watch " << (scratch / "exec").string() << ": " << std::strerror(errno) << std::endl;
+    }
+    start.arrive_and_wait();
+
+    for (int cycle = 0; cycle < bench.cycles; cycle++) {
+        int64_t login = monotonic_ns();
+        if (mkdir(runtime_dir.c_str(), 0700) != 0) {
+            std::cerr << "Failed to create " << runtime_dir.string() << ": " << std::strerror(errno) << std::endl;
+            std::lock_guard lock(out.mutex);
+            out.failures++;
+            break;
+        }
+        std::optional<std::pair<int64_t, pid_t>> exec = wait_for_exec(inotify_fd, exec_file, login + timeout_ns);
+        int pidfd = exec.has_value() ? pidfd_open(exec->second, 0) : -1;
+        std::filesystem::remove(exec_file);
+
+        int64_t logout = monotonic_ns();
+        rmdir(runtime_dir.c_str());
+        pollfd exited = {pidfd, POLLIN, 0};
+        bool torn_down = pidfd != -1 && poll(&exited, 1, (int)bench.timeout.count()) == 1;
+        int64_t teardown_done = monotonic_ns();
+        if (pidfd != -1) {
+            close(pidfd);
+        }
+
+        std::lock_guard lock(out.mutex);
+        if (!exec.has_value() || !torn_down) {
+            std::cerr << "uid=" << uid << " " << (exec.has_value() ? "Teardown" : "Spawn") << " failed or timed out" << std::endl;
+            out.failures++;
+            break; // A late stub would be mistaken for the next cycle's
+        }
+        out.spawn_ns.push_back(exec->first - login);
+        out.teardown_ns.push_back(teardown_done - logout);
+    }
+    if (inotify_fd != -1) {
+        close(inotify_fd);
+    }
+}
+
+void print_latency(const char* name, std::vector<int64_t> samples) {
+    if (samples.empty()) {
+        printf("%-9s no samples\n", name);
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double fraction) {
+        size_t index = (size_t)(fraction * (double)samples.size());
+        return (double)samples[std::min(index, samples.size() - 1)] / 1e6;
+    };
+    printf("%-9s p50 %8.3fms  p99 %8.3fms  max %8.3fms  (%zu samples)\n", name, percentile(0.50), percentile(0.99),
+        (double)samples.back() / 1e6, samples.size());
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bench_options bench;
+    if (!parse_bench_options(argc, argv, bench)) {
+        return EXIT_FAILURE;
+    }
+    if (geteuid() != 0) {
+        std::cerr << "Skipping, as spawning as other users needs root" << std::endl;
+        return skipped_exit_code;
+    }
+
+    std::optional<std::filesystem::path> scratch = create_scratch(bench);
+    if (!scratch.has_value()) {
+        return EXIT_FAILURE;
+    }
+    pid_t daemon = start_daemon(bench, scratch.value());
+    if (daemon == -1) {
+        std::cerr << "Left " << scratch->string() << " in place" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    results out;
+    std::barrier start(bench.users);
+    std::vector<std::thread> users;
+    for (int uid = bench.first_uid; uid < bench.first_uid + bench.users; uid++) {
+        users.emplace_back(run_user, std::cref(bench), std::cref(scratch.value()), uid, std::ref(start), std::ref(out));
+    }
+    for (std::thread& user : users) {
+        user.join();
+    }
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, nullptr, 0);
+
+    printf("%d users, %d logins and logouts each%s\n", bench.users, bench.cycles, bench.spawn_helper ? ", through the spawn helper" : "");
+    print_latency("spawn", out.spawn_ns); // From mkdir to the stub being exec'd
+    print_latency("teardown", out.teardown_ns); // From rmdir to the stub having exited
+    if (out.failures > 0) {
+        printf("%d users failed, see %s\n", out.failures, (scratch.value() / "daemon.log").c_str());
+        return EXIT_FAILURE;
+    }
+    std::error_code error;
+    std::filesystem::remove_all(scratch.value(), error);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,181 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+// Times spawn_process against what it replaced: fork, then dropping privileges and calling execve in the child. Both
+// are timed until the new program is running, which spawn_process returns at, and which is seen for fork as the
+// child's end of an O_CLOEXEC pipe closing. --ballast-mb grows our address space first, like a long running daemon's,
+// as that is what fork pays for in copying page tables.
+//
+// It needs root, to drop privileges, and exits with 77 without it, which meson treats as a skipped test.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <grp.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "spawn.h"
+
+namespace {
+
+const int skipped_exit_code = 77;
+
+struct bench_options {
+    int iterations = 1000;
+    size_t ballast_mb = 0;
+    uid_t uid = 65534; // nobody
+    gid_t gid = 65534;
+    std::string program = "/bin/true";
+};
+
+void print_usage(const char* program) {
+    std::cout << "Usage: " << program << " [options]\n"
+        << "  --iterations <count>\n"
+        << "                    Spawns timed for each method (default: 1000)\n"
+        << "  --ballast-mb <mb> Memory to allocate and touch before timing, to grow the address space (default: 0)\n"
+        << "  --uid <uid>, --gid <gid>\n"
+        << "                    Who to spawn as (default: 65534)\n"
+        << "  --program <path>  What to spawn (default: /bin/true)" << std::endl;
+}
+
+bool parse_bench_options(int argc, char** argv, bench_options& bench) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--program" && i + 1 < argc) {
+            bench.program = argv[++i];
+        } else if ((arg == "--iterations" || arg == "--ballast-mb" || arg == "--uid" || arg == "--gid") && i + 1 < argc) {
+            long value = atol(argv[++i]);
+            if (value < 0 || (value == 0 && arg == "--iterations")) {
+                std::cerr << arg << " must be a positive number" << std::endl;
+                return false;
+            }
+            if (arg == "--iterations") bench.iterations = (int)value;
+            else if (arg == "--ballast-mb") bench.ballast_mb = (size_t)value;
+            else if (arg == "--uid") bench.uid = (uid_t)value;
+            else bench.gid = (gid_t)value;
+        } else {
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+// The fork path as it was: everything past fork happens in a copy of our address space
+std::optional<pid_t> fork_exec(const spawn_request& request) {
+    std::vector<char*> argv;
+    for (const std::string& argument : request.arguments) {
+        argv.push_back(const_cast<char*>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+    std::vector<char*> envp;
+    for (const std::string& variable : request.environment) {
+        envp.push_back(const_cast<char*>(variable.c_str()));
+    }
+    envp.push_back(nullptr);
+
+    int exec_pipe[2];
+    if (pipe2(exec_pipe, O_CLOEXEC) == -1) {
+        return std::nullopt;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (setgroups(request.groups.size(), request.groups.data()) == 0 && setgid(request.gid) == 0
+            && setuid(request.uid) == 0) {
+            execve(request.program.c_str(), argv.data(), envp.data());
+        }
+        int error = errno;
+        (void)!write(exec_pipe[1], &error, sizeof(error));
+        _exit(127);
+    }
+    close(exec_pipe[1]);
+    int error = 0;
+    ssize_t length;
+    while ((length = read(exec_pipe[0], &error, sizeof(error))) == -1 && errno == EINTR) {}
+    close(exec_pipe[0]);
+    if (pid == -1 || length != 0) {
+        if (pid != -1) {
+            waitpid(pid, nullptr, 0);
+        }
+        return std::nullopt;
+    }
+    return pid;
+}
+
+std::optional<pid_t> clone_exec(const spawn_request& request) {
+    std::optional<spawned_process> spawned = spawn_process(request);
+    if (!spawned.has_value()) {
+        return std::nullopt;
+    }
+    close(spawned->pidfd);
+    return spawned->pid;
+}
+
+// Each child is reaped straight after, outside of the timing, so that they never pile up
+bool run(const char* name, const bench_options& bench, const spawn_request& request,
+    const std::function<std::optional<pid_t>(const spawn_request&)>& spawn) {
+    std::vector<int64_t> samples;
+    for (int i = 0; i < bench.iterations; i++) {
+        auto start = std::chrono::steady_clock::now();
+        std::optional<pid_t> pid = spawn(request);
+        auto done = std::chrono::steady_clock::now();
+        if (!pid.has_value()) {
+            std::cerr << name << ": failed to spawn " << request.program << std::endl;
+            return false;
+        }
+        waitpid(pid.value(), nullptr, 0);
+        samples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(done - start).count());
+    }
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&](double fraction) {
+        size_t index = (size_t)(fraction * (double)samples.size());
+        return (double)samples[std::min(index, samples.size() - 1)] / 1e3;
+    };
+    printf("%-14s p50 %9.1fus  p99 %9.1fus  max %9.1fus\n", name, percentile(0.50), percentile(0.99),
+        (double)samples.back() / 1e3);
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bench_options bench;
+    if (!parse_bench_options(argc, argv, bench)) {
+        return EXIT_FAILURE;
+    }
+    if (geteuid() != 0) {
+        std::cerr << "Skipping, as dropping privileges needs root" << std::endl;
+        return skipped_exit_code;
+    }
+    log_start();
+
+    std::vector<char> ballast(bench.ballast_mb * 1024 * 1024);
+    for (size_t i = 0; i < ballast.size(); i += 4096) {
+        ballast[i] = 1; // Touched, so that the pages are really mapped
+    }
+
+    spawn_request request = {};
+    request.uid = bench.uid;
+    request.gid = bench.gid;
+    request.groups = {bench.gid};
+    request.program = bench.program;
+    request.arguments = {bench.program};
+    request.environment = {"PATH=/usr/bin/"};
+
+    printf("%d spawns of %s each, with %zu MiB of ballast\n", bench.iterations, bench.program.c_str(), bench.ballast_mb);
+    bool succeeded = run("fork+execve", bench, request, fork_exec) && run("spawn_process", bench, request, clone_exec);
+    log_stop();
+    return succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,37 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+// Stands in for a user's dinit in the login storm benchmark. It records when it was exec'd, as CLOCK_MONOTONIC
+// nanoseconds along with its PID, in <directory>/<uid>, and then waits to be signalled like dinit would.
+
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <directory>\n", argv[0]);
+        return 1;
+    }
+
+    // Written beside it and renamed over it, so that the benchmark never reads it half written
+    std::string path = std::string(argv[1]) + "/" + std::to_string(getuid());
+    std::string temporary = path + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "w");
+    if (out == nullptr) {
+        perror(temporary.c_str());
+        return 1;
+    }
+    fprintf(out, "%lld %d\n", (long long)now.tv_sec * 1000000000LL + now.tv_nsec, (int)getpid());
+    if (fclose(out) != 0 || rename(temporary.c_str(), path.c_str()) != 0) {
+        perror(path.c_str());
+        return 1;
+    }
+
+    // SIGTERM from the daemon keeps its default action, and ends this
+    while (true) {
+        pause();
+    }
+}
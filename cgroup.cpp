@@ -0,0 +1,255 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "cgroup.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <string>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "loop.h"
+
+namespace {
+
+const char* const controllers[] = {"memory", "cpu", "pids"};
+// A cgroup cannot be removed until the kernel has finished with its last process, which takes a moment after a kill
+const std::chrono::milliseconds removal_retry_interval{100};
+const int removal_attempts = 50;
+
+struct user_cgroup {
+    std::filesystem::path path;
+    int memory_current_fd = -1; // Kept open, so reading stats is a pread each
+    int cpu_stat_fd = -1;
+    int removal_attempts_left = 0;
+    timer_id removal_timer = 0;
+};
+
+std::filesystem::path cgroup_root;
+std::map<int, user_cgroup> cgroups; // Keyed by UID
+
+bool write_file(const std::filesystem::path& path, const std::string& value) {
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    bool written = write(fd, value.data(), value.size()) == (ssize_t)value.size();
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return written;
+}
+
+std::optional<uint64_t> read_number(int fd, const char* key) {
+    char buffer[512];
+    ssize_t length = pread(fd, buffer, sizeof(buffer) - 1, 0);
+    if (length <= 0) {
+        return std::nullopt;
+    }
+    buffer[length] = '\0';
+    const char* value = buffer;
+    if (key != nullptr) {
+        // A flat keyed file, such as cpu.stat
+        value = strstr(buffer, key);
+        if (value == nullptr) {
+            return std::nullopt;
+        }
+        value += strlen(key);
+    }
+    return strtoull(value, nullptr, 10);
+}
+
+bool populated(const user_cgroup& group) {
+    std::ifstream events(group.path / "cgroup.events");
+    std::string key;
+    int value;
+    while (events >> key >> value) {
+        if (key == "populated") {
+            return value != 0;
+        }
+    }
+    return false;
+}
+
+user_cgroup& track_cgroup(int uid) {
+    user_cgroup& group = cgroups[uid];
+    group.path = cgroup_root / ("user-" + std::to_string(uid));
+    loop_cancel(group.removal_timer);
+    group.removal_timer = 0;
+    if (group.memory_current_fd == -1) {
+        group.memory_current_fd = open((group.path / "memory.current").c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    if (group.cpu_stat_fd == -1) {
+        group.cpu_stat_fd = open((group.path / "cpu.stat").c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    return group;
+}
+
+// Without cgroup.kill, each process is killed in turn. Anything forked in the meantime is caught on a later attempt.
+void kill_by_hand(const user_cgroup& group) {
+    std::ifstream procs(group.path / "cgroup.procs");
+    pid_t pid;
+    while (procs >> pid) {
+        kill(pid, SIGKILL);
+    }
+}
+
+void try_remove(int uid) {
+    auto it = cgroups.find(uid);
+    if (it == cgroups.end()) {
+        return;
+    }
+    user_cgroup& group = it->second;
+    group.removal_timer = 0;
+    if (rmdir(group.path.c_str()) == 0 || errno == ENOENT) {
+        cgroups.erase(it);
+        return;
+    }
+    if (errno != EBUSY || --group.removal_attempts_left <= 0) {
+        log_error(uid) << "Failed to remove cgroup " << group.path.string() << ": " << std::strerror(errno);
+        cgroups.erase(it);
+        return;
+    }
+    if (populated(group) && !cgroup_kill(uid)) {
+        kill_by_hand(group);
+    }
+    group.removal_timer = loop_schedule(removal_retry_interval, [uid] { try_remove(uid); });
+}
+
+} // namespace
+
+bool cgroup_init(const std::filesystem::path& root) {
+    if (!std::filesystem::exists(root.parent_path() / "cgroup.controllers")) {
+        log_error() << root.parent_path().string() << " is not part of a cgroup v2 hierarchy!";
+        return false;
+    }
+    std::error_code error;
+    std::filesystem::create_directories(root, error);
+    if (error) {
+        log_error() << "Failed to create cgroup " << root.string() << ": " << error.message();
+        return false;
+    }
+    for (const char* controller : controllers) {
+        // The parent may well have it enabled already
+        write_file(root.parent_path() / "cgroup.subtree_control", std::string("+") + controller);
+        if (!write_file(root / "cgroup.subtree_control", std::string("+") + controller)) {
+            log_error() << "Failed to enable the " << controller << " controller in " << root.string() << ": "
+                << std::strerror(errno) << ", its limits will not be applied";
+        }
+    }
+    cgroup_root = root;
+    log_info() << "Placing sessions in cgroups under " << root.string();
+    return true;
+}
+
+bool cgroups_enabled() {
+    return !cgroup_root.empty();
+}
+
+std::optional<std::filesystem::path> cgroup_prepare(int uid, const configuration& config) {
+    std::filesystem::path path = cgroup_root / ("user-" + std::to_string(uid));
+    if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+        log_error(uid) << "Failed to create cgroup " << path.string() << ": " << std::strerror(errno);
+        return std::nullopt;
+    }
+    user_cgroup& group = track_cgroup(uid);
+
+    // Written even when unset, so a reused cgroup does not keep limits the user has since removed. Failing to reset
+    // one is only worth reporting if the user asked for it, as its controller may simply not be enabled.
+    struct limit {
+        const char* file;
+        std::string value;
+        bool requested;
+    };
+    limit limits[] = {
+        {"memory.max", config.memory_max.empty() ? "max" : config.memory_max, !config.memory_max.empty()},
+        {"cpu.weight", std::to_string(config.cpu_weight == 0 ? 100 : config.cpu_weight), config.cpu_weight != 0},
+        {"pids.max", config.pids_max == 0 ? "max" : std::to_string(config.pids_max), config.pids_max != 0},
+    };
+    for (const limit& setting : limits) {
+        if (!write_file(group.path / setting.file, setting.value) && setting.requested) {
+            log_error(uid) << "Failed to set " << setting.file << " to " << setting.value << ": " << std::strerror(errno);
+        }
+    }
+    return group.path / "cgroup.procs";
+}
+
+bool cgroup_adopt(int uid, pid_t pid) {
+    std::ifstream procs(cgroup_root / ("user-" + std::to_string(uid)) / "cgroup.procs");
+    pid_t member;
+    while (procs >> member) {
+        if (member == pid) {
+            track_cgroup(uid);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool cgroup_kill(int uid) {
+    auto it = cgroups.find(uid);
+    if (it == cgroups.end()) {
+        return false;
+    }
+    return write_file(it->second.path / "cgroup.kill", "1");
+}
+
+void cgroup_release(int uid) {
+    auto it = cgroups.find(uid);
+    if (it == cgroups.end()) {
+        return;
+    }
+    user_cgroup& group = it->second;
+    if (group.memory_current_fd != -1) {
+        close(group.memory_current_fd);
+        group.memory_current_fd = -1;
+    }
+    if (group.cpu_stat_fd != -1) {
+        close(group.cpu_stat_fd);
+        group.cpu_stat_fd = -1;
+    }
+    // Whatever escaped dinit's own shutdown
+    if (populated(group)) {
+        log_info(uid) << "Killing the processes left in " << group.path.string();
+        if (!cgroup_kill(uid)) {
+            kill_by_hand(group);
+        }
+    }
+    group.removal_attempts_left = removal_attempts;
+    try_remove(uid);
+}
+
+std::optional<cgroup_stats> cgroup_read_stats(int uid) {
+    auto it = cgroups.find(uid);
+    if (it == cgroups.end() || it->second.memory_current_fd == -1 || it->second.cpu_stat_fd == -1) {
+        return std::nullopt;
+    }
+    std::optional<uint64_t> memory = read_number(it->second.memory_current_fd, nullptr);
+    std::optional<uint64_t> cpu = read_number(it->second.cpu_stat_fd, "usage_usec ");
+    if (!memory.has_value() || !cpu.has_value()) {
+        return std::nullopt;
+    }
+    return cgroup_stats {memory.value(), cpu.value()};
+}
+
+std::optional<uint64_t> cgroup_cpu_usec(int uid) {
+    auto it = cgroups.find(uid);
+    if (it == cgroups.end() || it->second.cpu_stat_fd == -1) {
+        return std::nullopt;
+    }
+    return read_number(it->second.cpu_stat_fd, "usage_usec ");
+}
+
+bool cgroup_freeze(int uid, bool frozen) {
+    auto it = cgroups.find(uid);
+    if (it == cgroups.end()) {
+        errno = ENOENT;
+        return false;
+    }
+    return write_file(it->second.path / "cgroup.freeze", frozen ? "1" : "0");
+}
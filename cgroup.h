@@ -0,0 +1,39 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <sys/types.h>
+#include "config.h"
+
+// Sessions can each be placed in a cgroup v2 of their own, user-<uid> under a root cgroup given to the daemon. This
+// applies the user's resource limits, lets everything a session started be killed in one go, and makes the session's
+// resource usage cheap to read.
+
+// Creates the root cgroup and enables the controllers the limits need in it
+bool cgroup_init(const std::filesystem::path& root);
+bool cgroups_enabled();
+
+// Creates the user's cgroup, or reuses one left over, and applies their limits. Returns the cgroup.procs file for the
+// spawned child to move itself into.
+std::optional<std::filesystem::path> cgroup_prepare(int uid, const configuration& config);
+// Resumes managing the cgroup of a session which survived a daemon restart, if pid is in it
+bool cgroup_adopt(int uid, pid_t pid);
+// SIGKILLs everything in the user's cgroup at once. Returns false if this kernel cannot, so it must be done by hand.
+bool cgroup_kill(int uid);
+// Kills anything left in the user's cgroup, then removes it once the kernel has finished tearing it down
+void cgroup_release(int uid);
+
+struct cgroup_stats {
+    uint64_t memory_bytes;
+    uint64_t cpu_usec;
+};
+
+std::optional<cgroup_stats> cgroup_read_stats(int uid);
+// Works without the cpu controller, unlike the rest of cgroup_stats needing theirs
+std::optional<uint64_t> cgroup_cpu_usec(int uid);
+
+// Stops or resumes everything in the user's cgroup through cgroup.freeze. The kernel completes a freeze in the
+// background, and a frozen cgroup can still be killed.
+bool cgroup_freeze(int uid, bool frozen);
@@ -1,21 +1,28 @@
 // Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
 
 #include "config.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
-#include <iostream>
 #include <fstream>
 #include <string>
 #include <toml++/toml.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "configuration_example.h"
+#include "log.h"
 
 bool ensure_path(std::filesystem::path path) {
  if (!std::filesystem::exists(path)) {
         // Create the path if it doesn't exist
         try {
             std::filesystem::create_directories(path);
-            std::cout << "[LOG] Created dir: " << path.c_str() << std::endl;
+            log_info() << "Created dir: " << path.c_str();
         } catch (const std::filesystem::filesystem_error& e) {
-            std::cerr << "[ERROR] Failed to create directory: " << e.what() << " Error Code: " << e.code() << std::endl;
+            log_error() << "Failed to create directory: " << e.what() << " Error Code: " << e.code();
             return false;
         }
     }
@@ -27,12 +34,12 @@ bool ensure_file(std::filesystem::path path, std::string content) {
         // create the boot service - it doesn't exist
         std::ofstream output_file(path);
         if (!output_file) {
-            std::cerr << "[ERROR] Failed to open boot file in " << path.c_str() << std::endl;
+            log_error() << "Failed to open boot file in " << path.c_str();
             return false;
         }
         output_file << content;
         output_file.close();
-        std::cout << "[LOG] Wrote file: " << path.c_str() << std::endl;
+        log_info() << "Wrote file: " << path.c_str();
     }
     return true;
 }
@@ -41,7 +48,7 @@ bool check_path(std::filesystem::path path) {
     if (std::filesystem::exists(path)) {
         return true;
     }
-    std::cout << "[LOG] Path did not exist: " << path.string() << std::endl;
+    log_debug() << "Path did not exist: " << path.string();
     return false;
 }
 
@@ -49,7 +56,7 @@ bool check_file(std::filesystem::path path) {
     if (std::filesystem::exists(path)) {
         return true;
     }
-    std::cout << "[LOG] File did not exist: " << path.string() << std::endl;
+    log_debug() << "File did not exist: " << path.string();
     return false;
 }
 
@@ -97,9 +104,61 @@ bool ensure_config(std::string home) {
     return true;
 }
 
+// Only installed for those with a ready_timeout, as it is all that reports to the daemon's FIFO
+bool ensure_ready_service(std::string home) {
+    std::filesystem::path dinitd_path = home + dinitd_dir;
+    std::filesystem::path boot_d_dir = dinitd_path / "boot.d";
+    if (ensure_path(boot_d_dir) == false) { return false; }
+
+    // Listed in boot.d the way dinitctl enable would, as a symlink to the service
+    std::filesystem::path ready_path = dinitd_path / ready_service_name;
+    std::filesystem::path ready_link = boot_d_dir / ready_service_name;
+    if (ensure_file(ready_path, ready_service) == false) { return false; }
+    if (!std::filesystem::is_symlink(ready_link) && !std::filesystem::exists(ready_link)) {
+        std::error_code error;
+        std::filesystem::create_symlink(std::filesystem::path("..") / ready_service_name, ready_link, error);
+        if (error) {
+            log_error() << "Failed to link " << ready_link.string() << ": " << error.message();
+            return false;
+        }
+        log_info() << "Linked: " << ready_link.c_str();
+    }
+
+    return true;
+}
+
+bool check_ready_service_exists(std::string home) {
+    std::filesystem::path dinitd_path = home + dinitd_dir;
+    return check_file(dinitd_path / ready_service_name) && check_file(dinitd_path / "boot.d" / ready_service_name);
+}
+
+// A number of bytes with an optional K, M, G or T suffix, or max. Checked as it is written into a root owned file.
+bool valid_memory_max(const std::string& value) {
+    if (value == "max") {
+        return true;
+    }
+    size_t digits = 0;
+    while (digits < value.size() && value[digits] >= '0' && value[digits] <= '9') {
+        digits++;
+    }
+    if (digits == 0 || digits > 18) {
+        return false;
+    }
+    return digits == value.size() || (digits + 1 == value.size() && std::string("KMGT").find(value[digits]) != std::string::npos);
+}
+
+// A plain file name, as it is created in the user's runtime directory. It must not contain ':' either, which separates
+// the names in LISTEN_FDNAMES.
+bool valid_socket_name(const std::string& name) {
+    if (name.empty() || name.size() > 64 || name == "." || name == "..") {
+        return false;
+    }
+    return std::none_of(name.begin(), name.end(), [](char c) { return c == '/' || c == ':' || (unsigned char)c < 0x20; });
+}
+
 void did_parse(bool parsed, std::string arg_name) {
     if (!parsed) {
-        std::cout << "[LOG] Did not parse: " << arg_name << std::endl;
+        log_debug() << "Did not parse: " << arg_name;
     }
 }
 
@@ -112,23 +171,84 @@ void parse_boolean(std::shared_ptr<toml::table> config, bool& target_bool, std::
             parsed = true;
             target_bool = opt->get();
         } else {
-            std::cerr << "[ERROR] Value of " << arg_name << " was not a bool" << std::endl;
+            log_error() << "Value of " << arg_name << " was not a bool";
+        }
+    }
+    did_parse(parsed, arg_name);
+}
+
+// Parses an integer, clamping it to [min_value, max_value]
+void parse_integer(std::shared_ptr<toml::table> config, int& target_int, std::string arg_name, int min_value, int max_value) {
+    bool parsed = false;
+    auto node = config->get(arg_name);
+    if (node) {
+        if (node->is_integer()) {
+            int64_t value = node->as_integer()->get();
+            parsed = true;
+            if (value < min_value || value > max_value) {
+                log_error() << "Value of " << arg_name << " must be between " << min_value << " and " << max_value << ", clamping it";
+                value = std::clamp<int64_t>(value, min_value, max_value);
+            }
+            target_int = (int)value;
+        } else {
+            log_error() << "Value of " << arg_name << " was not an integer";
         }
     }
     did_parse(parsed, arg_name);
 }
 
-std::optional<configuration> get_config(std::string home) {
+// The toml is read as root, from a path the user controls, so only a regular file of theirs, of a sensible size, is
+// read at all. Anything else, such as a fifo which would block us or a symlink to a device which never ends, is refused
+// as it is opened.
+std::optional<std::string> read_user_file(const std::filesystem::path& path, uid_t owner) {
+    int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        log_error((int)owner) << "Failed to open " << path.string() << ": " << std::strerror(errno);
+        return std::nullopt;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == -1 || !S_ISREG(info.st_mode) || (info.st_uid != owner && info.st_uid != 0)
+        || info.st_size > (off_t)max_config_size) {
+        log_error((int)owner) << path.string() << " is not a regular file of theirs, of at most " << max_config_size << " bytes";
+        close(fd);
+        return std::nullopt;
+    }
+
+    // Read up to one byte past the limit, as it may have grown since the fstat
+    std::string contents(max_config_size + 1, '\0');
+    size_t length = 0;
+    while (length < contents.size()) {
+        ssize_t result = read(fd, contents.data() + length, contents.size() - length);
+        if (result == -1 && errno == EINTR) continue;
+        if (result <= 0) {
+            break;
+        }
+        length += result;
+    }
+    close(fd);
+    if (length > max_config_size) {
+        log_error((int)owner) << path.string() << " is larger than " << max_config_size << " bytes";
+        return std::nullopt;
+    }
+    contents.resize(length);
+    return contents;
+}
+
+std::optional<configuration> get_config(std::string home, uid_t owner) {
     std::filesystem::path config_path = home + config_dir;
     std::filesystem::path spawn_dir = config_path / "dinit-user-spawn.toml";
 
     std::shared_ptr<toml::table> config;
     configuration ret = {};
 
+    std::optional<std::string> contents = read_user_file(spawn_dir, owner);
+    if (!contents.has_value()) {
+        return std::nullopt;
+    }
     try {
-        config = std::make_shared<toml::table>(toml::parse_file(spawn_dir.c_str()));
+        config = std::make_shared<toml::table>(toml::parse(contents.value(), spawn_dir.string()));
     } catch (const toml::parse_error& e) {
-        std::cerr << "[ERROR] TOML parse error: " << e.description() << " at " << e.source().begin << std::endl;
+        log_error() << "TOML parse error: " << e.description() << " at " << e.source().begin;
         return std::nullopt;
     }
 
@@ -141,7 +261,7 @@ std::optional<configuration> get_config(std::string home) {
             parsed = true;
             ret.binary = opt->get();
         } else {
-            std::cerr << "[ERROR] Value of binary was not a string" << std::endl;
+            log_error() << "Value of binary was not a string";
         }
     }
     did_parse(parsed, "binary");
@@ -156,7 +276,7 @@ std::optional<configuration> get_config(std::string home) {
                 if (auto val = element.value<std::string>()) {  // try to get int value
                     ret.arguments.push_back(*val);
                 } else {
-                    std::cerr << "[ERROR] Arg in dinit_arguments was not a string" << std::endl;
+                    log_error() << "Arg in dinit_arguments was not a string";
                 }
             }
         }
@@ -165,6 +285,49 @@ std::optional<configuration> get_config(std::string home) {
     parsed = false;
 
     parse_boolean(config, ret.verbose_debug, "verbose_debug");
+    parse_integer(config, ret.stop_timeout, "stop_timeout", 0, max_stop_timeout);
+    parse_integer(config, ret.linger, "linger", 0, max_linger);
+    parse_integer(config, ret.ready_timeout, "ready_timeout", 0, max_ready_timeout);
+    parse_integer(config, ret.restart_attempts, "restart_attempts", 0, max_restart_attempts);
+    parse_integer(config, ret.restart_delay, "restart_delay", 1, max_restart_delay);
+    parse_integer(config, ret.freeze_after, "freeze_after", 0, max_freeze_after);
+    parse_boolean(config, ret.lazy, "lazy");
+
+    parsed = false;
+    auto lazy_sockets = config->get("lazy_sockets");
+    if (lazy_sockets) {
+        if (lazy_sockets->is_array()) {
+            parsed = true;
+            for (const auto& element : *lazy_sockets->as_array()) {
+                auto name = element.value<std::string>();
+                if (!name || !valid_socket_name(*name)) {
+                    log_error() << "Entry in lazy_sockets was not a plain file name";
+                } else if (ret.lazy_sockets.size() == max_lazy_sockets) {
+                    log_error() << "Only the first " << max_lazy_sockets << " lazy_sockets are used";
+                    break;
+                } else {
+                    ret.lazy_sockets.push_back(*name);
+                }
+            }
+        } else {
+            log_error() << "Value of lazy_sockets was not an array";
+        }
+    }
+    did_parse(parsed, "lazy_sockets");
+
+    parsed = false;
+    auto memory_max = config->get("memory_max");
+    if (memory_max) {
+        if (memory_max->is_string() && valid_memory_max(memory_max->as_string()->get())) {
+            parsed = true;
+            ret.memory_max = memory_max->as_string()->get();
+        } else {
+            log_error() << "Value of memory_max was not a size such as \"512M\", or \"max\"";
+        }
+    }
+    did_parse(parsed, "memory_max");
+    parse_integer(config, ret.cpu_weight, "cpu_weight", 0, max_cpu_weight);
+    parse_integer(config, ret.pids_max, "pids_max", 0, max_pids_max);
 
     return ret;
 }
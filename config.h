@@ -4,6 +4,7 @@
 #include <optional>
 #include <string>
 #include <vector>
+#include <sys/types.h>
 
 const std::string dinitd_dir = "/.config/dinit.d/";
 const std::string config_dir = "/.config/dinit.d/config/";
@@ -13,12 +14,55 @@ type = internal
 waits-for.d: ./boot.d/
 )";
 
+// Reports back once boot has started, for sessions with a ready_timeout. It is added to boot.d, so it is started with
+// boot, and as a process service it counts as started straight away, so it does not hold boot up whilst it waits for
+// it. It does nothing unless the daemon is waiting on the fifo.
+const std::string ready_service_name = "dinit-user-spawn-ready";
+const std::string ready_fifo_name = "dinit-user-spawn-ready"; // In XDG_RUNTIME_DIR
+const std::string ready_service = R"(# Written by dinit-user-spawn, to let it know once boot has started
+type = process
+command = /bin/sh -c "dinitctl start boot > /dev/null && [ -p \"$XDG_RUNTIME_DIR/)" + ready_fifo_name + R"(\" ] && echo ready > \"$XDG_RUNTIME_DIR/)" + ready_fifo_name + R"(\""
+restart = false
+)";
+
 struct configuration {
     std::string binary = "/usr/bin/dinit";
     std::vector<std::string> arguments;
     bool verbose_debug = false;
+    int stop_timeout = 10; // Seconds between SIGTERM and SIGKILL at logout
+    int linger = 0; // Seconds to keep the instance after logout, incase the user logs straight back in
+    int ready_timeout = 0; // Seconds to wait for boot to start, as reported by the ready_service, 0 to not wait
+    int restart_attempts = 5; // Restarts in a row after dinit crashes whilst logged in, 0 to never restart it
+    int restart_delay = 1; // Seconds before the first of them, doubling for each further one
+    int freeze_after = 0; // Seconds idle before the session's cgroup is frozen, 0 to never freeze it
+    bool lazy = false; // Only spawn once one of lazy_sockets is connected to, rather than at login
+    std::vector<std::string> lazy_sockets; // Names of sockets in XDG_RUNTIME_DIR, listened on until then
+    // Limits for the user's cgroup, when the daemon places sessions in cgroups. Empty or 0 leaves the kernel default.
+    std::string memory_max;
+    int cpu_weight = 0;
+    int pids_max = 0;
 };
 
+const int max_stop_timeout = 300;
+const int max_linger = 3600;
+const int max_ready_timeout = 300;
+const int max_freeze_after = 86400;
+const int max_restart_attempts = 100;
+const int max_restart_delay = 60;
+const int max_cpu_weight = 100; // The kernel's default, so a user can lower their share but not raise it above others
+const int max_pids_max = 4194304;
+const size_t max_lazy_sockets = 16;
+const size_t max_config_size = 256 * 1024; // Of dinit-user-spawn.toml, in bytes
+
+bool valid_memory_max(const std::string& value);
+bool valid_socket_name(const std::string& name);
+
 bool ensure_config(std::string home);
+bool ensure_ready_service(std::string home);
+// The daemon runs these as the user, by executing itself with one of these options followed by their home
+const std::string generate_config_option = "--generate-config";
+const std::string generate_ready_service_option = "--generate-ready-service";
 bool check_config_exists(std::string home);
-std::optional<configuration> get_config(std::string home);
+bool check_ready_service_exists(std::string home);
+// Parses the user's dinit-user-spawn.toml, which must be a regular file owned by them (or root)
+std::optional<configuration> get_config(std::string home, uid_t owner);
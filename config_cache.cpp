@@ -0,0 +1,254 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "config_cache.h"
+#include <fstream>
+#include <sstream>
+#include <type_traits>
+#include <unordered_map>
+#include <variant>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "loop.h"
+#include "state_file.h"
+
+namespace {
+
+// Bump whenever the layout of the persisted file (or config_fields) changes, older files are then ignored
+const std::string cache_header = "dinit-user-spawn-config-cache 9";
+
+// Longest string accepted from a persisted cache, anything beyond this means the file is not one of ours
+const size_t max_string_length = 64 * 1024;
+
+struct file_identity {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    timespec modified;
+    timespec changed; // Unlike mtime, this cannot be set back by the user to fake an unchanged file
+
+    bool operator==(const file_identity& other) const {
+        return device == other.device && inode == other.inode && size == other.size
+            && modified.tv_sec == other.modified.tv_sec && modified.tv_nsec == other.modified.tv_nsec
+            && changed.tv_sec == other.changed.tv_sec && changed.tv_nsec == other.changed.tv_nsec;
+    }
+};
+
+struct cache_entry {
+    std::string home;
+    file_identity identity;
+    bool valid; // False if the file failed to parse, so a broken config is not reparsed on every login
+    configuration config;
+};
+
+std::unordered_map<int, cache_entry> cache; // Keyed by UID
+
+std::optional<file_identity> identify(const std::filesystem::path& path) {
+    struct stat info;
+    if (lstat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) {
+        return std::nullopt;
+    }
+    return file_identity {info.st_dev, info.st_ino, info.st_size, info.st_mtim, info.st_ctim};
+}
+
+void write_string(std::ostream& out, const std::string& value) {
+    out << value.size() << ':' << value << ' ';
+}
+
+bool read_string(std::istream& in, std::string& value) {
+    size_t length;
+    if (!(in >> length) || length > max_string_length || in.get() != ':') {
+        return false;
+    }
+    value.resize(length);
+    return (bool)in.read(value.data(), length) && in.get() == ' ';
+}
+
+// Every persisted member of struct configuration, in the order they are written. Adding a key to configuration only
+// needs a line here, and a bump of cache_header. Values are checked against the same bounds the parser clamps to, as
+// the file decides what is exec'd and what limits are applied.
+struct flag_field {
+    bool configuration::* member;
+};
+struct integer_field {
+    int configuration::* member;
+    int min_value;
+    int max_value;
+};
+struct string_field {
+    std::string configuration::* member;
+    bool (*valid)(const std::string& value); // Or nullptr for anything
+};
+struct list_field {
+    std::vector<std::string> configuration::* member;
+    size_t max_count;
+    bool (*valid)(const std::string& value); // Or nullptr for anything
+};
+using config_field = std::variant<flag_field, integer_field, string_field, list_field>;
+
+const config_field config_fields[] = {
+    string_field {&configuration::binary, nullptr},
+    list_field {&configuration::arguments, max_string_length, nullptr},
+    flag_field {&configuration::verbose_debug},
+    integer_field {&configuration::stop_timeout, 0, max_stop_timeout},
+    integer_field {&configuration::linger, 0, max_linger},
+    integer_field {&configuration::ready_timeout, 0, max_ready_timeout},
+    integer_field {&configuration::restart_attempts, 0, max_restart_attempts},
+    integer_field {&configuration::restart_delay, 1, max_restart_delay},
+    integer_field {&configuration::freeze_after, 0, max_freeze_after},
+    flag_field {&configuration::lazy},
+    list_field {&configuration::lazy_sockets, max_lazy_sockets, valid_socket_name},
+    string_field {&configuration::memory_max, [](const std::string& value) { return value.empty() || valid_memory_max(value); }},
+    integer_field {&configuration::cpu_weight, 0, max_cpu_weight},
+    integer_field {&configuration::pids_max, 0, max_pids_max},
+};
+
+void write_field(std::ostream& out, const configuration& config, const config_field& field) {
+    std::visit([&](const auto& field) {
+        using field_type = std::decay_t<decltype(field)>;
+        if constexpr (std::is_same_v<field_type, string_field>) {
+            write_string(out, config.*field.member);
+        } else if constexpr (std::is_same_v<field_type, list_field>) {
+            out << (config.*field.member).size() << ' ';
+            for (const std::string& value : config.*field.member) {
+                write_string(out, value);
+            }
+        } else {
+            out << config.*field.member << ' ';
+        }
+    }, field);
+}
+
+bool read_field(std::istream& in, configuration& config, const config_field& field) {
+    return std::visit([&](const auto& field) {
+        using field_type = std::decay_t<decltype(field)>;
+        if constexpr (std::is_same_v<field_type, string_field>) {
+            std::string& value = config.*field.member;
+            return read_string(in, value) && (field.valid == nullptr || field.valid(value));
+        } else if constexpr (std::is_same_v<field_type, list_field>) {
+            size_t count;
+            if (!(in >> count) || count > field.max_count || in.get() != ' ') {
+                return false;
+            }
+            std::vector<std::string>& values = config.*field.member;
+            values.clear();
+            for (size_t i = 0; i < count; i++) {
+                std::string value;
+                if (!read_string(in, value) || (field.valid != nullptr && !field.valid(value))) {
+                    return false;
+                }
+                values.push_back(std::move(value));
+            }
+            return true;
+        } else if constexpr (std::is_same_v<field_type, integer_field>) {
+            int& value = config.*field.member;
+            return (bool)(in >> value) && value >= field.min_value && value <= field.max_value && in.get() == ' ';
+        } else {
+            return (bool)(in >> config.*field.member) && in.get() == ' ';
+        }
+    }, field);
+}
+
+void write_entry(std::ostream& out, int uid, const cache_entry& entry) {
+    const file_identity& id = entry.identity;
+    out << uid << ' ' << id.device << ' ' << id.inode << ' ' << id.size << ' '
+        << id.modified.tv_sec << ' ' << id.modified.tv_nsec << ' ' << id.changed.tv_sec << ' ' << id.changed.tv_nsec << ' '
+        << entry.valid << ' ';
+    write_string(out, entry.home);
+    for (const config_field& field : config_fields) {
+        write_field(out, entry.config, field);
+    }
+    out << '\n';
+}
+
+bool read_entry(std::istream& in, int& uid, cache_entry& entry) {
+    file_identity& id = entry.identity;
+    if (!(in >> uid >> id.device >> id.inode >> id.size >> id.modified.tv_sec >> id.modified.tv_nsec
+        >> id.changed.tv_sec >> id.changed.tv_nsec >> entry.valid) || in.get() != ' ' || !read_string(in, entry.home)) {
+        return false;
+    }
+    for (const config_field& field : config_fields) {
+        if (!read_field(in, entry.config, field)) {
+            return false;
+        }
+    }
+    return in.get() == '\n';
+}
+
+void write_cache(std::ostream& out) {
+    out << cache_header << '\n';
+    for (const auto& [uid, entry] : cache) {
+        write_entry(out, uid, entry);
+    }
+}
+
+state_file persisted = {"config cache", write_cache, {}, false};
+
+} // namespace
+
+std::optional<configuration> load_user_config(int uid, const std::string& home, bool& config_exists) {
+    std::filesystem::path spawn_dir = std::filesystem::path(home + config_dir) / "dinit-user-spawn.toml";
+    std::optional<file_identity> identity = identify(spawn_dir);
+
+    auto it = cache.find(uid);
+    if (identity.has_value() && it != cache.end() && it->second.home == home && it->second.identity == identity.value()) {
+        config_exists = true;
+        if (!it->second.valid) {
+            return std::nullopt;
+        }
+        return it->second.config;
+    }
+
+    config_exists = check_config_exists(home);
+    if (!config_exists || !identity.has_value()) {
+        if (it != cache.end()) {
+            cache.erase(it);
+            state_file_schedule_write(persisted);
+        }
+        return config_exists ? get_config(home, uid) : std::nullopt;
+    }
+
+    // The identity was taken before parsing, so if the file changes underneath us the entry simply misses next time
+    std::optional<configuration> user_config = get_config(home, uid);
+    cache[uid] = {home, identity.value(), user_config.has_value(), user_config.value_or(configuration {})};
+    state_file_schedule_write(persisted);
+    return user_config;
+}
+
+void config_cache_clear() {
+    cache.clear();
+    state_file_schedule_write(persisted);
+}
+
+void config_cache_load(const std::filesystem::path& path) {
+    // This is read as root and decides what we exec for users
+    if (!state_file_trusted(path, "config cache")) {
+        return;
+    }
+
+    std::ifstream in(path);
+    std::string header;
+    if (!std::getline(in, header) || header != cache_header) {
+        log_info() << "Ignoring config cache " << path.string() << ", it is from a different version";
+        return;
+    }
+
+    std::unordered_map<int, cache_entry> loaded;
+    int uid;
+    cache_entry entry = {};
+    while (in.peek() != EOF) {
+        entry = {};
+        if (!read_entry(in, uid, entry)) {
+            log_error() << "Ignoring config cache " << path.string() << ", it is malformed!";
+            return;
+        }
+        loaded[uid] = std::move(entry);
+    }
+    cache = std::move(loaded);
+    log_info() << "Loaded " << cache.size() << " cached user configurations from " << path.string();
+}
+
+void config_cache_persist_to(const std::filesystem::path& path) {
+    state_file_persist_to(persisted, path);
+}
@@ -0,0 +1,19 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <filesystem>
+#include <optional>
+#include <string>
+#include "config.h"
+
+// Cache of parsed user configurations, keyed by the identity of dinit-user-spawn.toml (device, inode, size, mtime and
+// ctime). A relogin with an unchanged file costs a single stat instead of the full check_config_exists and a reparse.
+//
+// Sets config_exists the same way check_config_exists would, and returns nullopt if the configuration is invalid.
+std::optional<configuration> load_user_config(int uid, const std::string& home, bool& config_exists);
+void config_cache_clear();
+
+// The cache can be persisted, so that it survives daemon restarts. Entries read back are only ever used when they
+// match the live file's identity, exactly as in memory ones are.
+void config_cache_load(const std::filesystem::path& path);
+void config_cache_persist_to(const std::filesystem::path& path);
@@ -18,5 +18,30 @@ dinit_arguments = ["--user"]
 # Enables verbose debugging options. It will flood logs, in catlog.
 verbose_debug = false
 
+# Seconds to give your dinit to stop its services after you log out. After this, it and everything it started is sent SIGKILL. At most 300.
+stop_timeout = 10
+
+# Seconds to keep your dinit running after you log out. Logging back in within this window keeps the running instance, rather than stopping it and booting your services again. Anything kept in your runtime directory, such as dinit's control socket, is still removed at logout by whatever manages it. At most 3600, 0 stops it straight away.
+linger = 0
+
+# Seconds to wait for your boot service to start. How long this took, or that it never happened, is recorded for the system administrator. It is reported by the dinit-user-spawn-ready service, which is added to boot.d for you the first time you log in with this set, and uses dinitctl, so it relies on your dinit using its default socket path. At most 300, 0 does not wait for it.
+ready_timeout = 0
+
+# If your dinit crashes (exits with an error, or is killed) whilst you are still logged in, it is restarted after restart_delay seconds. Each further crash in a row doubles the wait, up to 5 minutes, and after restart_attempts of them it is left stopped until you log in again. Running for a minute counts as no longer crashing. Exiting cleanly, such as through dinitctl shutdown, is never restarted. restart_attempts is at most 100, 0 never restarts it. restart_delay is from 1 to 60.
+restart_attempts = 5
+restart_delay = 1
+
+# Seconds your session may sit idle before it is frozen, when the system places each session in its own cgroup. Idle means nothing has happened in your runtime directory, and your dinit and its services have used next to no CPU. Everything your dinit started is then paused until something happens in your runtime directory again, or you log back in. Checked every 15 seconds. At most 86400, 0 never freezes it.
+freeze_after = 0
+
+# Start your dinit only when it is first needed, rather than at login. The sockets named in lazy_sockets are created in your runtime directory (XDG_RUNTIME_DIR) and listened on for you, and the first connection to any of them spawns your dinit. It is passed them from fd 3 onwards following the LISTEN_FDS convention, named in LISTEN_FDNAMES, with that connection waiting to be accepted, so it is up to your setup to hand them to whatever serves them. At most 16 sockets. Without any, lazy does nothing.
+lazy = false
+# lazy_sockets = ["pipewire-0", "wayland-1"]
+
+# Resource limits for your session, applied when the system places each session in its own cgroup. memory_max is a size such as "2G", or "max". cpu_weight is your share of CPU time under contention, from 1 to 100 (the default). pids_max limits how many processes you may have. Leave them unset, or 0, for no limit.
+# memory_max = "2G"
+# cpu_weight = 100
+# pids_max = 4096
+
 # There used to be a minimal_environment_handling variable, but this was removed and now is always enabled. This is because the previous method of trying to 'inherit' environment variables, didn't actually inherit many useful env vars. Therefore, if you are not doing what will be latter metioned, ensure your services do no depend on env vars beyond (SHELL, PWD, LOGNAME, HOME, SHLVL, XDG_RUNTIME_DIR, and PATH)  For those seeking to set environment variables, please use dinit_arguments to specify an environment file, or utilise the environment file option in dinit services.
 )";
@@ -0,0 +1,264 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "control.h"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <optional>
+#include <sstream>
+#include <unordered_map>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "activation.h"
+#include "cgroup.h"
+#include "config_cache.h"
+#include "log.h"
+#include "loop.h"
+#include "options.h"
+#include "passwd_cache.h"
+#include "session.h"
+
+namespace {
+
+// A command longer than this is not one of ours
+const size_t max_command_length = 256;
+// Clients that have not sent a full command by then are dropped, so they cannot hold connections open
+const std::chrono::seconds client_timeout{10};
+
+struct control_client {
+    std::string input;
+    std::string output;
+    size_t written = 0;
+    bool responded = false;
+    timer_id timeout;
+};
+
+int listen_fd = -1;
+std::unordered_map<int, control_client> clients;
+std::function<void()> reconcile_callback;
+
+void close_client(int fd) {
+    auto it = clients.find(fd);
+    if (it == clients.end()) {
+        return;
+    }
+    loop_cancel(it->second.timeout);
+    loop_remove(fd);
+    close(fd);
+    clients.erase(it);
+}
+
+std::optional<int> parse_uid(std::istringstream& arguments) {
+    long uid;
+    if (!(arguments >> uid) || uid < 0 || !arguments.eof()) {
+        return std::nullopt;
+    }
+    return (int)uid;
+}
+
+std::string list_sessions() {
+    std::ostringstream out;
+    auto steady_now = std::chrono::steady_clock::now();
+    auto system_now = std::chrono::system_clock::now();
+    out << "UID PID STATE STARTED UPTIME READY MEMORY CPU\n";
+    for (const auto& [uid, tracked] : get_sessions()) {
+        auto uptime = std::chrono::duration_cast<std::chrono::seconds>(steady_now - tracked.start_time);
+        std::time_t started = std::chrono::system_clock::to_time_t(system_now - uptime);
+        std::tm started_tm;
+        localtime_r(&started, &started_tm);
+        out << uid << ' ' << tracked.pid << ' ' << session_state_name(tracked.state) << ' '
+            << std::put_time(&started_tm, "%Y-%m-%dT%H:%M:%S") << ' ' << uptime.count() << "s ";
+        if (tracked.time_to_ready.has_value()) {
+            out << std::fixed << std::setprecision(2) << std::chrono::duration<double>(tracked.time_to_ready.value()).count() << "s ";
+        } else if (tracked.readiness == session_readiness::not_requested) {
+            out << "- ";
+        } else {
+            out << session_readiness_name(tracked.readiness) << ' ';
+        }
+        std::optional<cgroup_stats> stats = tracked.in_cgroup ? cgroup_read_stats(uid) : std::nullopt;
+        if (stats.has_value()) {
+            out << stats->memory_bytes / 1024 << "K " << std::fixed << std::setprecision(2) << stats->cpu_usec / 1e6 << "s\n";
+        } else {
+            out << "- -\n";
+        }
+    }
+    for (int uid : activation_waiting_uids()) {
+        out << uid << " - lazy - - - - -\n";
+    }
+    for (const auto& [uid, backoff] : get_restarts()) {
+        if (backoff.timer != 0) {
+            out << uid << " - backoff - - - - -\n";
+        }
+    }
+    return out.str();
+}
+
+std::string run_command(const std::string& line) {
+    std::istringstream arguments(line);
+    std::string command;
+    arguments >> command;
+    arguments >> std::ws;
+
+    if (command == "list" && arguments.eof()) {
+        return "OK\n" + list_sessions();
+    } else if (command == "respawn" || command == "stop") {
+        std::optional<int> uid = parse_uid(arguments);
+        if (!uid.has_value()) {
+            return "ERROR usage: " + command + " <uid>\n";
+        }
+        if (command == "stop") {
+            // Also cancels a spawn in progress, a lazy session's sockets or a pending restart, as stop_session does
+            if (!get_sessions().contains(uid.value()) && !is_spawn_pending(uid.value()) && !activation_waiting(uid.value())
+                && !is_restart_pending(uid.value())) {
+                return "ERROR no session for UID " + std::to_string(uid.value()) + "\n";
+            }
+            stop_session(uid.value());
+        } else {
+            // Otherwise no logout would ever come to clean up after what is spawned
+            std::error_code error;
+            if (!std::filesystem::is_directory(options.monitored_path / std::to_string(uid.value()), error)) {
+                return "ERROR UID " + std::to_string(uid.value()) + " is not logged in\n";
+            }
+            respawn_user(uid.value());
+        }
+        return "OK\n";
+    } else if (command == "reconcile" && arguments.eof()) {
+        reconcile_callback();
+        return "OK\n";
+    } else if (command == "reload" && arguments.eof()) {
+        config_cache_clear();
+        passwd_cache_clear();
+        return "OK\n";
+    }
+    return "ERROR unknown command: " + line + "\n";
+}
+
+void client_write(int fd, control_client& client) {
+    while (client.written < client.output.size()) {
+        ssize_t length = send(fd, client.output.data() + client.written, client.output.size() - client.written, MSG_NOSIGNAL);
+        if (length == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                loop_modify(fd, EPOLLOUT);
+                return;
+            }
+            break;
+        }
+        client.written += length;
+    }
+    close_client(fd);
+}
+
+void client_ready(int fd) {
+    auto it = clients.find(fd);
+    if (it == clients.end()) {
+        return;
+    }
+    control_client& client = it->second;
+    if (client.responded) {
+        client_write(fd, client);
+        return;
+    }
+
+    char buffer[max_command_length];
+    while (true) {
+        ssize_t length = recv(fd, buffer, sizeof(buffer), 0);
+        if (length == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) break;
+            close_client(fd);
+            return;
+        }
+        if (length == 0) {
+            close_client(fd);
+            return;
+        }
+        client.input.append(buffer, length);
+        if (client.input.find('\n') != std::string::npos) {
+            break;
+        }
+        if (client.input.size() > max_command_length) {
+            close_client(fd);
+            return;
+        }
+    }
+
+    size_t newline = client.input.find('\n');
+    if (newline == std::string::npos) {
+        return;
+    }
+    std::string line = client.input.substr(0, newline);
+    log_info() << "Control command: " << line;
+
+    client.output = run_command(line);
+    client.responded = true;
+    loop_cancel(client.timeout);
+    client_write(fd, client);
+}
+
+void accept_clients() {
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) {
+                log_error() << "Failed to accept control connection: " << std::strerror(errno);
+            }
+            return;
+        }
+
+        // The socket file is already root only, but check the peer too in case its permissions were loosened
+        ucred credentials;
+        socklen_t length = sizeof(credentials);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == -1 || credentials.uid != 0) {
+            log_error() << "Rejected control connection from a non root peer!";
+            close(fd);
+            continue;
+        }
+
+        control_client& client = clients[fd];
+        client.timeout = loop_schedule(client_timeout, [fd] { close_client(fd); });
+        loop_add(fd, EPOLLIN, [fd](uint32_t) { client_ready(fd); });
+    }
+}
+
+} // namespace
+
+bool control_start(const std::filesystem::path& socket_path, std::function<void()> reconcile) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.string().size() >= sizeof(address.sun_path)) {
+        log_error() << "Control socket path is too long: " << socket_path.string();
+        return false;
+    }
+    socket_path.string().copy(address.sun_path, sizeof(address.sun_path) - 1);
+
+    std::error_code error;
+    std::filesystem::create_directories(socket_path.parent_path(), error);
+    unlink(socket_path.c_str()); // Left behind by a previous run
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        log_error() << "Failed to create the control socket: " << std::strerror(errno);
+        return false;
+    }
+    mode_t previous_umask = umask(0077);
+    int bound = bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+    umask(previous_umask);
+    if (bound == -1 || listen(listen_fd, 16) == -1) {
+        log_error() << "Failed to bind the control socket: " << std::strerror(errno);
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    reconcile_callback = std::move(reconcile);
+    loop_add(listen_fd, EPOLLIN, [](uint32_t) { accept_clients(); });
+    log_info() << "Control socket: " << socket_path.string();
+    return true;
+}
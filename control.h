@@ -0,0 +1,19 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <filesystem>
+#include <functional>
+#include <string>
+
+// Root only control socket, served from the event loop. Clients (see dinit-user-spawnctl) send a single command line,
+// and receive "OK" or "ERROR <reason>" followed by any output, after which the connection is closed.
+//
+// Commands:
+//   list              Tracked sessions, one per line
+//   respawn <uid>     Stop the user's dinit if running, then spawn a fresh one
+//   stop <uid>        Stop the user's dinit
+//   reconcile         Bring the tracked sessions in line with the monitored path
+//   reload            Drop cached user configurations and passwd entries, so they are reread on the next spawn
+const std::filesystem::path default_control_socket = "/run/dinit-user-spawn/control";
+
+bool control_start(const std::filesystem::path& socket_path, std::function<void()> reconcile);
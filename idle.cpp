@@ -0,0 +1,134 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "idle.h"
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "log.h"
+#include "loop.h"
+
+namespace {
+
+// Connecting to a socket is not seen by inotify, but most use of a session touches some file in its runtime directory
+const uint32_t activity_mask = IN_ACCESS | IN_MODIFY | IN_ATTRIB | IN_OPEN | IN_CREATE | IN_DELETE | IN_MOVED_FROM
+    | IN_MOVED_TO | IN_ONLYDIR;
+
+struct idle_session {
+    int watch = -1;
+    std::chrono::seconds threshold;
+    std::chrono::steady_clock::time_point last_activity;
+    std::optional<uint64_t> last_cpu_usec;
+};
+
+std::map<int, idle_session> sessions; // Keyed by UID
+std::unordered_map<int, int> watch_uids;
+int inotify_fd = -1;
+idle_callback on_idle_callback;
+idle_callback on_activity_callback;
+
+void handle_events() {
+    alignas(inotify_event) char buffer[4096];
+    while (true) {
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if (length == -1 && errno == EINTR) continue;
+        if (length <= 0) {
+            return;
+        }
+        for (char* position = buffer; position < buffer + length;) {
+            inotify_event* event = reinterpret_cast<inotify_event*>(position);
+            position += sizeof(inotify_event) + event->len;
+            auto uid = watch_uids.find(event->wd);
+            if (uid == watch_uids.end()) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                // The runtime directory is gone, which the logout handling takes care of
+                sessions[uid->second].watch = -1;
+                watch_uids.erase(uid);
+                continue;
+            }
+            sessions[uid->second].last_activity = std::chrono::steady_clock::now();
+            on_activity_callback(uid->second);
+        }
+    }
+}
+
+void check_idle() {
+    auto now = std::chrono::steady_clock::now();
+    auto busy_usec = (uint64_t)(std::chrono::duration_cast<std::chrono::microseconds>(idle_check_interval).count() * idle_cpu_fraction);
+    std::vector<int> idle;
+    for (auto& [uid, session] : sessions) {
+        std::optional<uint64_t> cpu_usec = cgroup_cpu_usec(uid);
+        if (cpu_usec.has_value() && session.last_cpu_usec.has_value() && cpu_usec.value() - session.last_cpu_usec.value() > busy_usec) {
+            session.last_activity = now;
+        }
+        session.last_cpu_usec = cpu_usec;
+        if (now - session.last_activity >= session.threshold) {
+            idle.push_back(uid);
+        }
+    }
+    // Collected first, as the callback may well untrack the session
+    for (int uid : idle) {
+        on_idle_callback(uid);
+    }
+    loop_schedule(idle_check_interval, check_idle);
+}
+
+} // namespace
+
+bool idle_start(idle_callback on_idle, idle_callback on_activity) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        log_error() << "Failed to create the idle tracking inotify instance: " << std::strerror(errno);
+        return false;
+    }
+    on_idle_callback = std::move(on_idle);
+    on_activity_callback = std::move(on_activity);
+    loop_add(inotify_fd, EPOLLIN, [](uint32_t) { handle_events(); });
+    loop_schedule(idle_check_interval, check_idle);
+    return true;
+}
+
+void idle_track(int uid, const std::filesystem::path& runtime_dir, std::chrono::seconds threshold) {
+    if (inotify_fd == -1) {
+        return;
+    }
+    idle_untrack(uid);
+    idle_session& session = sessions[uid];
+    session.threshold = threshold;
+    session.last_activity = std::chrono::steady_clock::now();
+    session.last_cpu_usec = cgroup_cpu_usec(uid);
+    session.watch = inotify_add_watch(inotify_fd, runtime_dir.c_str(), activity_mask);
+    if (session.watch == -1) {
+        log_error(uid) << "Failed to watch " << runtime_dir.string() << " for activity: " << std::strerror(errno);
+    } else {
+        watch_uids[session.watch] = uid;
+    }
+}
+
+void idle_untrack(int uid) {
+    auto it = sessions.find(uid);
+    if (it == sessions.end()) {
+        return;
+    }
+    if (it->second.watch != -1) {
+        inotify_rm_watch(inotify_fd, it->second.watch);
+        watch_uids.erase(it->second.watch);
+    }
+    sessions.erase(it);
+}
+
+void idle_reset(int uid) {
+    auto it = sessions.find(uid);
+    if (it != sessions.end()) {
+        it->second.last_activity = std::chrono::steady_clock::now();
+    }
+}
@@ -0,0 +1,21 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <chrono>
+#include <filesystem>
+#include <functional>
+
+// Sessions which opt in are watched for activity: anything happening in their runtime directory, or their cgroup using
+// more than a sliver of CPU between checks. A session idle for longer than its threshold is reported as idle at every
+// check, and activity in its runtime directory is reported as it happens.
+
+const std::chrono::seconds idle_check_interval{15};
+const double idle_cpu_fraction = 0.01; // Of the check interval, using less than this counts as idle
+
+using idle_callback = std::function<void(int uid)>;
+
+bool idle_start(idle_callback on_idle, idle_callback on_activity);
+void idle_track(int uid, const std::filesystem::path& runtime_dir, std::chrono::seconds threshold);
+void idle_untrack(int uid);
+// Counts as activity without reporting it, for activity the caller saw itself, such as a login
+void idle_reset(int uid);
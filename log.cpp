@@ -0,0 +1,266 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "log.h"
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+namespace {
+
+const size_t ring_size = 256; // Must be a power of two
+const size_t batch_size = 16 * 1024;
+
+// A bounded multi producer queue: a slot is free for the producer at position pos when its sequence is pos, and
+// holds a complete line for the writer once its sequence is pos + 1
+struct log_record {
+    std::atomic<size_t> sequence;
+    log_level level;
+    size_t length;
+    char text[log_line_size];
+};
+
+std::array<log_record, ring_size> ring;
+std::atomic<size_t> ring_head = 0; // Next position for a producer
+size_t ring_tail = 0; // Next position for the writer, only touched by it
+std::atomic<uint64_t> dropped = 0; // Lines lost to a full ring buffer
+
+std::atomic<log_level> minimum_level = log_level::info;
+std::atomic<bool> writer_running = false;
+std::atomic<bool> writer_stopping = false;
+std::atomic<bool> writer_idle = false;
+std::atomic<uint32_t> writer_wakeups = 0;
+std::thread writer;
+
+const char* level_tag(log_level level) {
+    switch (level) {
+    case log_level::debug: return "[DEBUG] ";
+    case log_level::info: return "[LOG] ";
+    case log_level::error: return "[ERROR] ";
+    }
+    return "";
+}
+
+int level_fd(log_level level) {
+    return level == log_level::error ? STDERR_FILENO : STDOUT_FILENO;
+}
+
+void write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        data += written;
+        length -= written;
+    }
+}
+
+// Async-signal-safe, as it only touches the buffer it is given
+char* append(char* out, char* end, const char* text) {
+    while (*text != '\0' && out < end) {
+        *out++ = *text++;
+    }
+    return out;
+}
+
+char* append_number(char* out, char* end, long long number) {
+    char digits[24];
+    int count = 0;
+    unsigned long long value = number < 0 ? -(unsigned long long)number : number;
+    do {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    if (number < 0 && out < end) {
+        *out++ = '-';
+    }
+    while (count > 0 && out < end) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+bool enqueue(log_level level, const char* text, size_t length) {
+    size_t position = ring_head.load(std::memory_order_relaxed);
+    log_record* record;
+    while (true) {
+        record = &ring[position & (ring_size - 1)];
+        size_t sequence = record->sequence.load(std::memory_order_acquire);
+        ptrdiff_t difference = (ptrdiff_t)sequence - (ptrdiff_t)position;
+        if (difference == 0) {
+            if (ring_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return false; // Full
+        } else {
+            position = ring_head.load(std::memory_order_relaxed);
+        }
+    }
+    record->level = level;
+    record->length = length;
+    memcpy(record->text, text, length);
+    record->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+// Writes out every complete line in the ring buffer, batching consecutive lines for the same stream into one write
+void drain() {
+    static char batch[batch_size];
+    size_t batch_length = 0;
+    int batch_fd = STDOUT_FILENO;
+
+    uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+    if (lost > 0) {
+        char notice[64];
+        char* end = append(notice, notice + sizeof(notice), level_tag(log_level::error));
+        end = append_number(end, notice + sizeof(notice) - 1, (long long)lost);
+        end = append(end, notice + sizeof(notice) - 1, " log lines were dropped\n");
+        write_all(STDERR_FILENO, notice, end - notice);
+    }
+
+    while (true) {
+        log_record& record = ring[ring_tail & (ring_size - 1)];
+        if (record.sequence.load(std::memory_order_acquire) != ring_tail + 1) {
+            break;
+        }
+        int fd = level_fd(record.level);
+        if (batch_length > 0 && (fd != batch_fd || batch_length + record.length > batch_size)) {
+            write_all(batch_fd, batch, batch_length);
+            batch_length = 0;
+        }
+        batch_fd = fd;
+        memcpy(batch + batch_length, record.text, record.length);
+        batch_length += record.length;
+        record.sequence.store(ring_tail + ring_size, std::memory_order_release);
+        ring_tail++;
+    }
+    if (batch_length > 0) {
+        write_all(batch_fd, batch, batch_length);
+    }
+}
+
+bool ring_empty() {
+    return ring[ring_tail & (ring_size - 1)].sequence.load(std::memory_order_acquire) != ring_tail + 1;
+}
+
+void writer_main() {
+    while (true) {
+        drain();
+        if (writer_stopping.load()) {
+            drain(); // Anything submitted whilst it was being noticed
+            return;
+        }
+        // Producers only wake us whilst we are idle, so check once more after saying so, incase a line was submitted
+        // in between
+        uint32_t wakeups = writer_wakeups.load();
+        writer_idle.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (ring_empty() && !writer_stopping.load()) {
+            writer_wakeups.wait(wakeups);
+        }
+        writer_idle.store(false);
+    }
+}
+
+void wake_writer() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writer_idle.exchange(false)) {
+        writer_wakeups.fetch_add(1);
+        writer_wakeups.notify_one();
+    }
+}
+
+} // namespace
+
+void log_set_level(log_level minimum) {
+    minimum_level = minimum;
+}
+
+void log_start() {
+    for (size_t i = 0; i < ring_size; i++) {
+        ring[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    // Started with every signal blocked, which it inherits, so that signals meant for the daemon's signalfd are never
+    // delivered to it instead, whether or not they are blocked yet
+    sigset_t all_signals;
+    sigset_t previous_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &previous_mask);
+    writer = std::thread(writer_main);
+    pthread_sigmask(SIG_SETMASK, &previous_mask, nullptr);
+    writer_running = true;
+    std::atexit(log_stop);
+}
+
+void log_stop() {
+    if (!writer_running.exchange(false)) {
+        return;
+    }
+    writer_stopping = true;
+    writer_wakeups.fetch_add(1);
+    writer_wakeups.notify_one();
+    writer.join();
+}
+
+void log_forked() {
+    // The writer handle is only a copy of the parent's, so the child must leave through _exit rather than join it
+    writer_running = false;
+}
+
+void log_raw(log_level level, int uid, const char* message, int error) {
+    char line[log_line_size];
+    char* end = line + sizeof(line) - 1;
+    char* out = append(line, end, level_tag(level));
+    out = append(out, end, "uid=");
+    out = append_number(out, end, uid);
+    out = append(out, end, " ");
+    out = append(out, end, message);
+    if (error != 0) {
+        out = append(out, end, ": errno ");
+        out = append_number(out, end, error);
+    }
+    *out++ = '\n';
+    write_all(level_fd(level), line, out - line);
+}
+
+log_line::log_line(log_level level, std::optional<int> uid, std::optional<pid_t> pid)
+    : level(level), enabled(level >= minimum_level.load(std::memory_order_relaxed)), buffer(text, text + sizeof(text) - 1), stream(&buffer) {
+    if (!enabled) {
+        return;
+    }
+    int saved_errno = errno; // So that a message may still use errno once the line has been started
+    stream << level_tag(level);
+    if (uid.has_value()) {
+        stream << "uid=" << uid.value() << ' ';
+    }
+    if (pid.has_value()) {
+        stream << "pid=" << pid.value() << ' ';
+    }
+    errno = saved_errno;
+}
+
+log_line::~log_line() {
+    if (!enabled) {
+        return;
+    }
+    size_t length = buffer.length();
+    text[length++] = '\n'; // Room was left for it
+    if (!writer_running.load(std::memory_order_relaxed)) {
+        write_all(level_fd(level), text, length);
+        return;
+    }
+    if (!enqueue(level, text, length)) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    wake_writer();
+}
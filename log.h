@@ -0,0 +1,71 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <optional>
+#include <ostream>
+#include <streambuf>
+#include <sys/types.h>
+
+// Log lines are formatted on the stack of whoever logs and copied into a preallocated ring buffer, which a writer thread
+// drains to stdout (errors to stderr) in batches. Logging therefore never waits on a write, and a burst of lines costs
+// a handful of writes rather than one each. Before log_start, or in a forked child, lines are written out directly.
+
+enum class log_level {
+    debug,
+    info,
+    error,
+};
+
+void log_set_level(log_level minimum);
+void log_start();
+void log_stop(); // Writes out whatever is left in the ring buffer, also done at exit
+
+// Forked children inherit neither the writer thread nor responsibility for the parent's buffered lines, so must call
+// this before logging
+void log_forked();
+
+// Async-signal-safe, for a child between fork and exec: formats without allocating and writes straight to stderr.
+// error is an errno value to append, or 0.
+void log_raw(log_level level, int uid, const char* message, int error = 0);
+
+const size_t log_line_size = 480; // Longer lines are truncated
+
+// One line, submitted once it goes out of scope, usually at the end of the statement
+class log_line {
+public:
+    log_line(log_level level, std::optional<int> uid, std::optional<pid_t> pid);
+    log_line(const log_line&) = delete;
+    log_line& operator=(const log_line&) = delete;
+    ~log_line();
+
+    template <typename T> log_line& operator<<(const T& value) {
+        if (enabled) {
+            stream << value;
+        }
+        return *this;
+    }
+
+private:
+    class fixed_buffer : public std::streambuf {
+    public:
+        fixed_buffer(char* begin, char* end) { setp(begin, end); }
+        size_t length() const { return pptr() - pbase(); }
+    };
+
+    log_level level;
+    bool enabled;
+    char text[log_line_size];
+    fixed_buffer buffer;
+    std::ostream stream;
+};
+
+// uid and pid are written as structured fields ahead of the message
+inline log_line log_debug(std::optional<int> uid = std::nullopt, std::optional<pid_t> pid = std::nullopt) {
+    return log_line(log_level::debug, uid, pid);
+}
+inline log_line log_info(std::optional<int> uid = std::nullopt, std::optional<pid_t> pid = std::nullopt) {
+    return log_line(log_level::info, uid, pid);
+}
+inline log_line log_error(std::optional<int> uid = std::nullopt, std::optional<pid_t> pid = std::nullopt) {
+    return log_line(log_level::error, uid, pid);
+}
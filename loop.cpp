@@ -0,0 +1,190 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "loop.h"
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace {
+
+struct watched_fd {
+    int fd;
+    loop_callback callback;
+};
+
+int epoll_fd = -1;
+bool running = false;
+uint64_t next_id = 1;
+
+// Keyed by an id rather than the fd, so that an event for a descriptor which was removed (and possibly reused)
+// earlier in the same batch is dropped instead of being delivered to the wrong callback.
+std::unordered_map<uint64_t, watched_fd> watched;
+std::unordered_map<int, uint64_t> fd_ids;
+std::vector<std::function<void()>> deferred;
+
+using timer_key = std::pair<std::chrono::steady_clock::time_point, timer_id>;
+int timer_fd = -1;
+timer_id next_timer_id = 1;
+std::map<timer_key, std::function<void()>> timers; // Ordered by deadline
+std::unordered_map<timer_id, std::chrono::steady_clock::time_point> timer_deadlines;
+
+// Point the timerfd at the earliest deadline, or disarm it if there is none
+void arm_timer_fd() {
+    itimerspec spec = {};
+    if (!timers.empty()) {
+        auto deadline = timers.begin()->first.first.time_since_epoch();
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(deadline);
+        spec.it_value.tv_sec = seconds.count();
+        spec.it_value.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - seconds).count();
+        if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+            spec.it_value.tv_nsec = 1; // Zero would disarm it
+        }
+    }
+    // steady_clock is CLOCK_MONOTONIC on Linux
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr) == -1) {
+        log_error() << "timerfd_settime failed: " << std::strerror(errno);
+    }
+}
+
+void run_expired_timers() {
+    uint64_t expirations;
+    while (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {}
+
+    auto now = std::chrono::steady_clock::now();
+    while (!timers.empty() && timers.begin()->first.first <= now) {
+        auto node = timers.extract(timers.begin());
+        timer_deadlines.erase(node.key().second);
+        node.mapped()();
+    }
+    arm_timer_fd();
+}
+
+} // namespace
+
+bool loop_init() {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        log_error() << "epoll_create1 failed: " << std::strerror(errno);
+        return false;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        log_error() << "timerfd_create failed: " << std::strerror(errno);
+        return false;
+    }
+    return loop_add(timer_fd, EPOLLIN, [](uint32_t) { run_expired_timers(); });
+}
+
+bool loop_add(int fd, uint32_t events, loop_callback callback) {
+    uint64_t id = next_id++;
+    epoll_event event = {};
+    event.events = events;
+    event.data.u64 = id;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        log_error() << "epoll_ctl add failed: " << std::strerror(errno);
+        return false;
+    }
+    watched.insert({id, {fd, std::move(callback)}});
+    fd_ids[fd] = id;
+    return true;
+}
+
+bool loop_modify(int fd, uint32_t events) {
+    auto it = fd_ids.find(fd);
+    if (it == fd_ids.end()) {
+        return false;
+    }
+    epoll_event event = {};
+    event.events = events;
+    event.data.u64 = it->second;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+        log_error() << "epoll_ctl modify failed: " << std::strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+void loop_remove(int fd) {
+    auto it = fd_ids.find(fd);
+    if (it == fd_ids.end()) {
+        return;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    watched.erase(it->second);
+    fd_ids.erase(it);
+}
+
+bool loop_run() {
+    const int max_events = 64;
+    epoll_event events[max_events];
+
+    running = true;
+    while (running) {
+        // Deferred callbacks may defer more work, which then runs in this same pass
+        while (!deferred.empty()) {
+            std::vector<std::function<void()>> pending;
+            pending.swap(deferred);
+            for (auto& callback : pending) {
+                callback();
+            }
+        }
+        if (!running) {
+            break;
+        }
+
+        int count = epoll_wait(epoll_fd, events, max_events, -1);
+        if (count == -1) {
+            if (errno == EINTR) continue;
+            log_error() << "epoll_wait failed: " << std::strerror(errno);
+            return false;
+        }
+
+        for (int i = 0; i < count; i++) {
+            auto it = watched.find(events[i].data.u64);
+            if (it == watched.end()) {
+                continue;
+            }
+            // Copy the callback, as it may remove its own entry
+            loop_callback callback = it->second.callback;
+            callback(events[i].events);
+        }
+    }
+    return true;
+}
+
+timer_id loop_schedule(std::chrono::steady_clock::duration delay, std::function<void()> callback) {
+    timer_id id = next_timer_id++;
+    auto deadline = std::chrono::steady_clock::now() + delay;
+    bool earliest = timers.empty() || deadline < timers.begin()->first.first;
+    timers.insert({{deadline, id}, std::move(callback)});
+    timer_deadlines.insert({id, deadline});
+    if (earliest) {
+        arm_timer_fd();
+    }
+    return id;
+}
+
+void loop_cancel(timer_id id) {
+    auto it = timer_deadlines.find(id);
+    if (it == timer_deadlines.end()) {
+        return;
+    }
+    timers.erase({it->second, id});
+    timer_deadlines.erase(it);
+    // Left armed if it was the earliest, run_expired_timers then simply finds nothing due
+}
+
+void loop_defer(std::function<void()> callback) {
+    deferred.push_back(std::move(callback));
+}
+
+void loop_stop() {
+    running = false;
+}
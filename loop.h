@@ -0,0 +1,25 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+// Single threaded epoll event loop. Every file descriptor the daemon waits on (inotify, signals, pidfds) is
+// registered here along with the callback that handles it, which receives the epoll event mask.
+using loop_callback = std::function<void(uint32_t events)>;
+
+bool loop_init();
+bool loop_add(int fd, uint32_t events, loop_callback callback);
+bool loop_modify(int fd, uint32_t events);
+void loop_remove(int fd);
+// Runs callback once the events of the current iteration have all been handled, which lets work be batched
+void loop_defer(std::function<void()> callback);
+
+// One shot timers, all multiplexed onto a single timerfd. Cancelling an id that has already fired is harmless.
+using timer_id = uint64_t;
+timer_id loop_schedule(std::chrono::steady_clock::duration delay, std::function<void()> callback);
+void loop_cancel(timer_id id);
+
+bool loop_run();
+void loop_stop();
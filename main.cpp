@@ -4,310 +4,443 @@
 #include <cstdlib>
 #include <cstring>
 #include <filesystem>
-#include <iostream>
 #include <map>
 #include <optional>
+#include <set>
 #include <string>
-#include <thread>
-#include <unordered_map>
 #include <vector>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 #include <unistd.h>
-#include <pwd.h>
-#include <grp.h>
 #include <sys/wait.h>
 #include <csignal>
 
+#include "activation.h"
+#include "cgroup.h"
 #include "config.h"
+#include "config_cache.h"
+#include "control.h"
+#include "idle.h"
+#include "log.h"
+#include "loop.h"
+#include "metrics.h"
+#include "options.h"
+#include "passwd_cache.h"
+#include "process_index.h"
+#include "session.h"
+#include "spawn_helper.h"
+
+namespace {
+
+const uint32_t monitored_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DELETE_SELF | IN_MOVE_SELF;
+const uint32_t ancestor_mask = IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_DELETE_SELF | IN_MOVE_SELF;
+
+int inotify_file_descriptor = -1;
+int monitored_watch = -1; // On the monitored path itself, once it exists
+int ancestor_watch = -1; // On the nearest existing ancestor, whilst the monitored path does not exist
+dev_t monitored_device = 0; // Identity of the watched directory, to notice another filesystem being mounted over it
+ino_t monitored_inode = 0;
+
+} // namespace
 
-const std::filesystem::path monitored_path = "/run/user";
-std::map<int, int> uid_pid_map;
+// Get the integer from a UID string, if it fails, then nullopt instead
+std::optional<int> get_int_from_name(std::string name) {
+    try {
+        int parsed_name = std::stoi(name);
+        return parsed_name;
+    } catch (const std::exception& e) {
+        log_error() << "Found entry: " << name << " in " << options.monitored_path.string() << ", but it was not an integer!";
+        return std::nullopt;
+    }
+}
 
-std::string get_env_var(const std::string& var) {
-    const char* val = std::getenv(var.c_str());
-    return val ? std::string(val) : std::string{};
+// Returns the UIDs of every user directory currently in the monitored path
+std::optional<std::set<int>> scan_monitored_path() {
+    std::set<int> users;
+    try {
+        for (const auto& entry: std::filesystem::directory_iterator(options.monitored_path)) {
+            std::string name = entry.path().filename().string();
+            if (entry.is_directory()) {
+                auto parsed_name = get_int_from_name(name);
+                if (parsed_name.has_value()) {
+                    users.insert(parsed_name.value());
+                }
+            } else {
+                log_error() << "Found entry: " << name << " in " << options.monitored_path
+                    << ", but it was not a directory!";
+            }
+        }
+    } catch (const std::filesystem::filesystem_error& e) {
+        log_error() << "Failed to access " << options.monitored_path.string() << ": " << e.what();
+        return std::nullopt;
+    }
+    return users;
 }
 
-// MUST RUN AS ROOT, GETS ENV VARS FOR SPECIFIED USER
-std::unordered_map<std::string, std::string> get_env_vars(passwd* pw) {
-    std::unordered_map<std::string, std::string> env_vars;
-    env_vars.insert({"XDG_RUNTIME_DIR", std::string("/run/user/" + std::to_string(pw->pw_uid))}); // Arbitrary env var we need
-    env_vars.insert({"PATH", "/usr/bin/"}); // Arbitrary, but most people will probably use this. Potentially remove in future.
-    env_vars.insert({"SHELL", pw->pw_shell});
-    env_vars.insert({"HOME", pw->pw_dir});
-    env_vars.insert({"LOGNAME", pw->pw_name});
+// Bring the tracked sessions in line with the monitored path, spawning for users without a session and cleaning
+// up after sessions whose user directory has gone. Returns false if the monitored path could not be read.
+bool reconcile() {
+    auto users = scan_monitored_path();
+    if (!users.has_value()) {
+        return false;
+    }
+    std::vector<int> logged_out;
+    for (const auto& [uid, tracked] : get_sessions()) {
+        if (!users->contains(uid)) {
+            logged_out.push_back(uid);
+        }
+    }
+    for (int uid : activation_waiting_uids()) {
+        if (!users->contains(uid)) {
+            logged_out.push_back(uid);
+        }
+    }
+    for (const auto& [uid, backoff] : get_restarts()) {
+        if (backoff.timer != 0 && !users->contains(uid)) {
+            logged_out.push_back(uid);
+        }
+    }
+    for (int uid : logged_out) {
+        handle_logout(uid);
+    }
+    for (int uid : users.value()) {
+        auto tracked = get_sessions().find(uid);
+        if (tracked == get_sessions().end() || tracked->second.state == session_state::lingering) {
+            handle_user(uid);
+        }
+    }
+    return true;
+}
 
-    return env_vars;
+std::filesystem::path nearest_existing_ancestor() {
+    std::error_code error;
+    std::filesystem::path ancestor = std::filesystem::absolute(options.monitored_path, error).parent_path();
+    while (!std::filesystem::is_directory(ancestor, error) && ancestor.has_relative_path()) {
+        ancestor = ancestor.parent_path();
+    }
+    return ancestor;
 }
 
-void handle_user(int uid) {
-    std::cout << "[LOG] Handling: " << uid << std::endl;
+// Watches the monitored path if it exists, otherwise its nearest existing ancestor, so that we hear of the path being
+// created without polling for it. Returns whether the monitored path itself is now watched.
+bool arm_watches() {
+    while (true) {
+        int watch = inotify_add_watch(inotify_file_descriptor, options.monitored_path.c_str(), monitored_mask);
+        if (watch != -1) {
+            struct stat monitored_stat = {};
+            stat(options.monitored_path.c_str(), &monitored_stat);
+            monitored_device = monitored_stat.st_dev;
+            monitored_inode = monitored_stat.st_ino;
+            monitored_watch = watch;
+            if (ancestor_watch != -1) {
+                inotify_rm_watch(inotify_file_descriptor, ancestor_watch);
+                ancestor_watch = -1;
+            }
+            return true;
+        }
+        if (errno != ENOENT && errno != ENOTDIR) {
+            log_error() << "inotify_add_watch failed: " << std::strerror(errno);
+            return false;
+        }
 
-    // Check UID is valid
-    passwd* pw = getpwuid(uid);
-    if (pw == nullptr) {
-        std::cerr << "[ERROR] UID of " << uid << " is invalid!" << std::endl;
-        return;
+        std::filesystem::path ancestor = nearest_existing_ancestor();
+        watch = inotify_add_watch(inotify_file_descriptor, ancestor.c_str(), ancestor_mask);
+        if (watch == -1) {
+            if (errno == ENOENT) {
+                continue; // Removed before we could watch it, so look further up
+            }
+            log_error() << "inotify_add_watch failed: " << std::strerror(errno);
+            return false;
+        }
+        if (ancestor_watch != -1 && ancestor_watch != watch) {
+            inotify_rm_watch(inotify_file_descriptor, ancestor_watch);
+        }
+        ancestor_watch = watch;
+
+        // It may have been created before the ancestor was watched, in which case no event will tell us about it
+        std::error_code error;
+        if (!std::filesystem::exists(options.monitored_path, error)) {
+            return false;
+        }
     }
+}
 
-    // Confirm there is no dinit process running. Note this is hardcoded to dinit as the binary option is meant to simply 
-    // specify where the dinit binary is - not meant to be something beyond dinit.
-    std::string command = "pgrep -x -u " + std::to_string(uid) + " dinit > /dev/null"; 
-    int execute_success = system(command.c_str());
-    if (execute_success == -1) {
-        std::cerr << uid << " [ERROR] System call failed, return code: " << execute_success << std::endl;
-        return;
+// Drops the watch on the monitored path and watches it afresh, reconciling with what it contains if it exists
+void rearm_watches() {
+    if (monitored_watch != -1) {
+        inotify_rm_watch(inotify_file_descriptor, monitored_watch);
+        monitored_watch = -1;
     }
-    int exit_code = WEXITSTATUS(execute_success);
-    if (exit_code == 0) {
-        std::cerr << uid << " [ERROR] There was already a dinit process running!" << std::endl;
-        return;
-    } else if (exit_code > 1) {
-        std::cerr << uid << " [ERROR] pgrep returned exit_code: " << exit_code << std::endl;
-        return;
+    if (arm_watches()) {
+        log_info() << "Monitored path: " << options.monitored_path.string() << " exists, reconciling!";
+        reconcile();
+    } else if (ancestor_watch != -1) {
+        log_info() << "Waiting until " << options.monitored_path.string() << " exists!";
+    } else {
+        log_error() << "Failed to watch " << options.monitored_path.string() << " or any of its parents!";
     }
+}
 
-    // UID is valid
-    pid_t pid = fork(); // Returns 0 to child process, returns child's PID to parent process
-    std::string process_id = std::to_string(getpid());
-    std::string struid = std::to_string(uid);
-    if (pid == -1) {
-        std::cerr << struid << " [ERROR] Failed to fork!" << std::endl;
-        return;
+// The mount table changed, which matters if a filesystem was mounted over or unmounted from the monitored path, as
+// our watch would then be left on a directory nobody uses
+void handle_mounts() {
+    struct stat monitored_stat = {};
+    if (stat(options.monitored_path.c_str(), &monitored_stat) != 0) {
+        return; // Gone, which the inotify watches will tell us about
     }
-
-    // Only continue if we are the child process - We must use exit from now on beyond this if
-    if (pid != 0) {
-        // Add pid to UID map
-        uid_pid_map.insert({uid, pid});
-        return;
+    if (monitored_watch == -1 || monitored_stat.st_dev != monitored_device || monitored_stat.st_ino != monitored_inode) {
+        log_info() << "Mounts changed under " << options.monitored_path.string() << ", watching it afresh";
+        rearm_watches();
     }
-    
-    // Clear the old environment, to avoid conflicting variables
-    clearenv();
-
-    // This is something that needs the upmost scrutiny - the program is still root here yet we parse their configuration.
-    // Since we do not act on user input directly until we drop privileges this is fine, but still be very wary when extending this.
-    std::string home = pw->pw_dir; // The home directory
-    bool config_exists = check_config_exists(home);
-    std::optional<configuration> user_config;
-
-    if (config_exists) {
-        user_config = get_config(home);
-        if (!user_config.has_value()) {
-            // Their config had errors in it, give them a new one
-            std::cerr << uid << " [ERROR] User's configuration was not valid! Giving them an empty one!" << std::endl;
-            user_config = configuration {};
+}
+
+void handle_signals(int signal_fd) {
+    signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+        case SIGCHLD: {
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                log_debug(std::nullopt, pid) << "Reaped child";
+                handle_reaped(pid, status);
+            }
+            break;
+        }
+        case SIGHUP:
+            log_info() << "Received SIGHUP, reconciling with " << options.monitored_path.string();
+            reconcile();
+            break;
+        case SIGTERM:
+            log_info() << "Received SIGTERM, exiting! User dinit processes are left running";
+            loop_stop();
+            break;
         }
-    } else {
-        // Their config never existed, we'll give them a new one
-        std::cout << uid << " [LOG] User's configuration path did not exist! Some paths or files did not exist! Giving them an empty config!" << std::endl;
-        user_config = configuration {};
     }
+}
 
-    // Get environment variables, still as root
-    std::unordered_map<std::string, std::string> env_vars = get_env_vars(pw);
+// Reads every queued event before acting on any of them, coalescing them into the final state of each user's
+// directory. A login and logout of the same UID within one batch is then a no-op, rather than a spawn and a kill.
+void handle_inotify() {
+    const size_t buf_len = 64 * 1024;
+    alignas(inotify_event) static char buffer[buf_len];
 
-    // Swap to the user
-    if (initgroups(pw->pw_name, pw->pw_gid) != 0) {
-        perror(std::string(struid + " [ERROR] initgroups failed").c_str());
-        exit(EXIT_FAILURE);
-    }
-    if (setgid(pw->pw_gid) != 0) {
-        perror(std::string(struid + " [ERROR] setgid failed").c_str());
-        exit(EXIT_FAILURE);
-    }
-    if (setuid(uid) != 0) {
-        perror(std::string(struid + " [ERROR] setuid failed").c_str());
-        exit(EXIT_FAILURE);
-    }
+    std::map<int, bool> present; // UID to whether their directory exists after the batch
+    bool overflowed = false;
+    bool rearm = false;
 
-    // Check we have fully swapped, to prevent privilege escalation issues
-    if (geteuid() != pw->pw_uid || getegid() != pw->pw_gid) {
-        perror(std::string(struid + " [ERROR] Failed to drop privileges").c_str());
-        exit(EXIT_FAILURE);
-    }
+    while (true) {
+        ssize_t length = read(inotify_file_descriptor, buffer, buf_len);
+        if (length == -1) {
+            if (errno == EINTR) continue; // Added this to handle interrupts
+            if (errno != EAGAIN) {
+                log_error() << "Failed to read inotify_file_descriptor: " << std::strerror(errno);
+            }
+            break;
+        }
 
-    std::cout << process_id << " [LOG] Running as: " << getpwuid(getuid())->pw_name << std::endl;
+        for (char* ptr = buffer; ptr < buffer + length; ) {
+            inotify_event* event = static_cast<inotify_event*>(static_cast<void*>(ptr));
+            ptr += sizeof(inotify_event) + event->len;
+            metrics_increment(metrics_counter::inotify_events);
 
-    // We create the config, as the user to ensure it has correct permissions!
-    if (!config_exists) {
-        std::cout << uid << "[LOG] We previously determined the user's configuration path was not fully enstated, therefore we now regenerate any missing pieces!" << std::endl;
-        if (ensure_config(home) == false) {
-            std::cerr << uid << "[ERROR] Failed to create / regenerate the configuration directory!" << std::endl;
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflowed = true;
+                continue;
+            }
+            if (event->wd == ancestor_watch) {
+                rearm = true; // Something on the way to the monitored path appeared or went away
+                continue;
+            }
+            if (event->wd != monitored_watch) {
+                continue; // From a watch we have since dropped
+            }
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT | IN_IGNORED)) {
+                rearm = true;
+                continue;
+            }
+            if (event->len > 0) {
+                if (event->mask & IN_ISDIR) {
+                    auto parsed_name = get_int_from_name(event->name);
+                    if (!parsed_name.has_value()) {
+                        log_error() << "Tried to get name from directory event, it was not a pure int!";
+                        continue;
+                    }
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        present[parsed_name.value()] = true;
+                    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                        present[parsed_name.value()] = false;
+                    } else {
+                    // We specified IN_CREATE before, and hence should only receive these events
+                    log_error() << "Received event in monitored path, but it was not a creation nor deletion event!";
+                    }
+                } else {
+                    // Only directories should be added!
+                    log_error() << "Found entry: " << event->name << " in " << options.monitored_path
+                        << ", but it was not a directory!";
+                }
+            }
         }
     }
 
-    // Set new environment
-    for (const auto& pair: env_vars) {
-        setenv(pair.first.c_str(), pair.second.c_str(), 0); // Don't overwrite existing env vars
+    if (rearm) {
+        // Whatever happened to the monitored path, reconciling once it is watched again covers every event lost with it
+        if (monitored_watch != -1) {
+            log_error() << "Lost the watch on " << options.monitored_path.string() << ", watching it afresh";
+        }
+        rearm_watches();
+        return;
     }
 
-    if (user_config->verbose_debug) {
-        system("env"); // Prints current environment vars
+    if (overflowed) {
+        // Events were dropped, so the directory listing is the only thing left to go by
+        log_error() << "Inotify queue overflowed, reconciling with " << options.monitored_path.string();
+        reconcile();
+        return;
     }
 
-    // Run the dinit process, using the user's specified binary
-    std::string program = user_config->binary;
-    std::vector<char*> dinit_args;
-
-    dinit_args.push_back(const_cast<char*>(program.c_str())); // First arg must be program name
-    for (auto& arg : user_config.value().arguments) {
-        dinit_args.push_back(const_cast<char*>(arg.c_str()));
-        if (user_config->verbose_debug) {
-            std::cout << uid << "[LOG] Added dinit arg: " << arg << std::endl;
+    for (const auto& [uid, exists] : present) {
+        auto tracked = get_sessions().find(uid);
+        if (exists) {
+            // Nothing to do for a running session whose directory was only recreated
+            if (tracked == get_sessions().end() || tracked->second.state != session_state::running) {
+                handle_user(uid);
+            }
+        } else if (tracked != get_sessions().end() || is_spawn_pending(uid) || activation_waiting(uid) || is_restart_pending(uid)) {
+            handle_logout(uid);
         }
     }
-    dinit_args.push_back(nullptr); // Null-terminate args
-
-    execv(program.c_str(), dinit_args.data());
-    perror("[ERROR] Execv failed!");
-    exit(EXIT_FAILURE); // if we somehow make it past the execv
 }
 
-// Get the integer from a UID string, if it fails, then nullopt instead
-std::optional<int> get_int_from_name(std::string name) {
-    try {
-        int parsed_name = std::stoi(name);
-        return parsed_name;
-    } catch (const std::exception& e) {
-        std::cerr << "[ERROR] Found entry: " << name << " in " << monitored_path.string() << ", but it was not an integer!" << std::endl;
-        return std::nullopt;
+int main(int argc, char** argv) {
+    // Not run as the daemon, but as a user whose configuration it is generating, see generate_config_as_user
+    if (argc == 3 && (argv[1] == generate_config_option || argv[1] == generate_ready_service_option)) {
+        log_start();
+        bool generated = argv[1] == generate_config_option ? ensure_config(argv[2]) : ensure_ready_service(argv[2]);
+        log_stop();
+        return generated ? EXIT_SUCCESS : EXIT_FAILURE;
     }
-}
 
-void reap_child(int sig) {
-    (void)sig;
-    int status;
-    pid_t pid;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-
-        // Use write rather than cout to avoid potential issues
-        char buffer[64];
-        int len = snprintf(buffer, sizeof(buffer), "[LOG] Reaped child PID: %d\n", (int)pid);
-        write(STDOUT_FILENO, buffer, len);
+    if (!parse_options(argc, argv)) {
+        exit(EXIT_FAILURE);
     }
-}
+    log_set_level(options.minimum_log_level);
+    log_start();
 
-int main() {
     if (geteuid() != 0) {
-        std::cerr << "[ERROR] Program must be ran with root privileges!" << std::endl;
+        log_error() << "Program must be ran with root privileges!";
         exit(EXIT_FAILURE);
     }
 
-    //signal(SIGCHLD, reap_child); // Register listener that repsonds to kernel requests to reap zombie processes.
-    // Set up proper signal handling
-    struct sigaction sa = {};
-    //memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = reap_child;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
-    
-    if (sigaction(SIGCHLD, &sa, nullptr) == -1) {
-        perror("[ERROR] sigaction failed");
+    // Signals are received through a signalfd in the event loop rather than asynchronous handlers
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGCHLD);
+    sigaddset(&signal_mask, SIGTERM);
+    sigaddset(&signal_mask, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &signal_mask, nullptr) == -1) {
+        log_error() << "sigprocmask failed: " << std::strerror(errno);
         exit(EXIT_FAILURE);
     }
-
-    // Stall the program until /run/users exists
-    bool print_once = false;
-    while (!std::filesystem::exists(monitored_path)) {
-        if (print_once == false) {
-            std::cout << "[LOG] Stalling until " << monitored_path.string() << " exists!" << std::endl;
-            print_once = true;
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100)); // sleep 100 millisecodns
+    int signal_fd = signalfd(-1, &signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        log_error() << "signalfd failed: " << std::strerror(errno);
+        exit(EXIT_FAILURE);
     }
-    std::cout << "[LOG] Monitored path: " << monitored_path.string() << " exists, continuing!" << std::endl;
 
-    
-    // Incase we are started after some users have already logged in (should not occur in normal scenarios)
-    std::vector<int> queued_users;
-    try {
-        for (const auto& entry: std::filesystem::directory_iterator(monitored_path)) {
-            std::string name = entry.path().filename().string();
-            if (entry.is_directory()) {
-                auto parsed_name = get_int_from_name(name);
-                if (parsed_name.has_value()) {
-                    queued_users.push_back(parsed_name.value());
-                }
-            } else {
-                std::cerr << "[ERROR] Found entry: " << name << " in " << monitored_path
-                    << ", but it was not a directory!" << std::endl;
-            }
-        }
-    } catch (const std::filesystem::filesystem_error& e) {
-        std::cerr << "[EXIT] Failed to access " << monitored_path.string() << ": " << e.what() << std::endl;
+    if (!loop_init()) {
         exit(EXIT_FAILURE);
     }
 
-    // Handle these users, if any
-    for (int uid: queued_users) {
-        handle_user(uid);
+    if (!options.cgroup_root.empty() && !cgroup_init(options.cgroup_root)) {
+        log_error() << "Failed to set up cgroups, sessions stay in the daemon's cgroup!";
+    }
+
+    // Started early, so that the helper's address space stays as small as possible
+    if (options.spawn_helper && !spawn_helper_start(handle_spawned, [](pid_t pid, int status) { handle_reaped(pid, status); })) {
+        log_error() << "Failed to start the spawn helper, spawning directly instead!";
     }
 
-    // Create inotify instance (blocking)
-    int inotify_file_descriptor = inotify_init();
+    // Started after the spawn helper, so that it does not inherit the worker threads
+    if (!passwd_cache_start(handle_passwd, options.passwd_file)) {
+        log_error() << "Failed to start the passwd workers, looking users up on the event loop instead!";
+    }
+
+    if (cgroups_enabled() && !idle_start(handle_idle, handle_activity)) {
+        log_error() << "Failed to start idle tracking, sessions will not be frozen!";
+    }
+
+    // Create inotify instance
+    inotify_file_descriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
     if (inotify_file_descriptor == -1) {
-        perror("[ERROR] inotify_init failed");
+        log_error() << "inotify_init failed: " << std::strerror(errno);
         return -1;
     }
 
-    // Add a watch for creation and deletion
-    int watch_descriptor = inotify_add_watch(inotify_file_descriptor, monitored_path.string().c_str(), IN_CREATE | IN_DELETE); // TODO ADD KILL COMMAND FOR USERS WHO LOGOUT! USE A MAP - STORE PIDs upon fork, and then kill(pid, SIGTERM), on removal!
-    if (watch_descriptor == -1) {
-        perror("[ERROR] inotify_add_watch failed");
+    // Add a watch for creation and deletion. This is done before the initial scan, so no login can slip between the two.
+    // If it does not exist yet, we instead wait on its creation from within the event loop.
+    bool monitored_exists = arm_watches();
+    if (!monitored_exists && ancestor_watch == -1) {
         close(inotify_file_descriptor);
         return -1;
     }
+    if (monitored_exists) {
+        log_info() << "Monitored path: " << options.monitored_path.string() << " exists, continuing!";
+    } else {
+        log_info() << "Waiting until " << options.monitored_path.string() << " exists!";
+    }
 
-    std::cout << "[LOG] Monitoring directory: " << monitored_path.string() << std::endl;
+    if (!options.config_cache_file.empty()) {
+        config_cache_load(options.config_cache_file);
+        config_cache_persist_to(options.config_cache_file);
+    }
 
-    const size_t buf_len = 4096;
-    char buffer[buf_len];
+    // Index any dinit processes that are already running, such as ones started via another method
+    process_index_scan();
 
-    while (true) {
-        ssize_t length = read(inotify_file_descriptor, buffer, buf_len);
-        if (length == -1) {
-            if (errno == EINTR) continue; // Added this to handle interrupts
-            perror("[ERROR] Failed to read inotify_file_descriptor");
-            break;
-        }
+    // After a restart, take back the user dinit processes that survived us, so their logouts are still handled
+    if (!options.state_file.empty()) {
+        adopt_sessions(options.state_file);
+        sessions_persist_to(options.state_file);
+    }
 
-        for (char* ptr = buffer; ptr < buffer + length; ) {
-            inotify_event* event = static_cast<inotify_event*>(static_cast<void*>(ptr));
+    // Incase we are started after some users have already logged in, or logged in or out whilst we were restarting
+    if (monitored_exists && !reconcile()) {
+        log_error() << "Failed to access " << options.monitored_path.string();
+        exit(EXIT_FAILURE);
+    }
 
-            if (event->len > 0) {
-                if (event->mask & IN_ISDIR) {
-                    auto parsed_name = get_int_from_name(event->name);
-                    if (!parsed_name.has_value()) {
-                        std::cerr << "[ERROR] Tried to get name from directory event, it was not a pure int!" << std::endl;
-                        continue;
-                    }
-                    if (event->mask & IN_CREATE) {
-                        handle_user(parsed_name.value());
-                    } else if (event->mask & IN_DELETE) {
-                        if (uid_pid_map.find(parsed_name.value()) != uid_pid_map.end()) {
-                            kill(uid_pid_map.at(parsed_name.value()), SIGTERM);
-                            std::cout << "[LOG] Cleaning up UID: " << parsed_name.value() << std::endl;
-                        } else {
-                            std::cerr << "[ERROR] Tried to clean up after UID: " << parsed_name.value() << " but failed to find matching PID!" << std::endl; 
-                        }
-                    } else {
-                    // We specified IN_CREATE before, and hence should only receive these events
-                    std::cerr << "[ERROR] Received event in monitored path, but it was not a creation nor deletion event!" << std::endl;
-                    }
-                } else {
-                    // Only directories should be added!
-                    std::cerr << "[ERROR] Found entry: " << event->name << " in " << monitored_path
-                        << ", but it was not a directory!" << std::endl;
-                }
-            }
-            ptr += sizeof(inotify_event) + event->len;
-        }
+    loop_add(signal_fd, EPOLLIN, [signal_fd](uint32_t) { handle_signals(signal_fd); });
+    loop_add(inotify_file_descriptor, EPOLLIN, [](uint32_t) { handle_inotify(); });
+
+    // Becomes readable with EPOLLPRI whenever the mount table changes
+    int mounts_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    if (mounts_fd == -1) {
+        log_error() << "Failed to open /proc/self/mountinfo, mounts over the monitored path will go unnoticed: " << std::strerror(errno);
+    } else {
+        loop_add(mounts_fd, EPOLLPRI, [](uint32_t) { handle_mounts(); });
+    }
+
+    if (!options.control_socket.empty() && !control_start(options.control_socket, [] { reconcile(); })) {
+        log_error() << "Failed to start the control socket, continuing without it!";
     }
 
+    if (!options.metrics_file.empty()) {
+        metrics_start(options.metrics_file, options.metrics_interval);
+    }
+
+    log_info() << "Monitoring directory: " << options.monitored_path.string();
+
+    bool clean_exit = loop_run();
+
     // Cleanup
-    close(watch_descriptor);
+    if (mounts_fd != -1) {
+        close(mounts_fd);
+    }
     close(inotify_file_descriptor);
-    return 0;
+    close(signal_fd);
+    return clean_exit ? 0 : -1;
 }
@@ -0,0 +1,171 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "metrics.h"
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <sstream>
+
+#include "activation.h"
+#include "cgroup.h"
+#include "log.h"
+#include "loop.h"
+#include "session.h"
+
+namespace {
+
+// Upper bounds in seconds, spanning a fast clone through to a slow directory server lookup
+const std::array<double, 15> bucket_bounds = {
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5,
+};
+
+struct histogram {
+    std::array<uint64_t, bucket_bounds.size()> buckets = {}; // Not cumulative, that is done when writing
+    uint64_t count = 0;
+    double sum = 0;
+};
+
+const char* phase_names[] = {
+    "passwd_lookup", "instance_check", "config_load", "fork", "privilege_drop", "exec",
+};
+
+struct counter_info {
+    const char* name;
+    const char* help;
+};
+
+const counter_info counter_infos[] = {
+    {"dinit_user_spawn_spawns_total", "User dinit processes spawned."},
+    {"dinit_user_spawn_spawn_failures_total", "Logins that did not result in a user dinit process."},
+    {"dinit_user_spawn_kills_total", "Signals sent to user dinit processes."},
+    {"dinit_user_spawn_reaps_total", "Tracked user dinit processes that have exited."},
+    {"dinit_user_spawn_inotify_events_total", "Inotify events read from the monitored path."},
+    {"dinit_user_spawn_linger_resumes_total", "Logins that kept a lingering dinit instance instead of spawning one."},
+    {"dinit_user_spawn_ready_failures_total", "User dinit processes that exited or passed their ready_timeout before their boot service started."},
+    {"dinit_user_spawn_activations_total", "Lazy sessions whose dinit was spawned by a connection to one of their sockets."},
+    {"dinit_user_spawn_freezes_total", "Sessions frozen after being idle for their freeze_after."},
+    {"dinit_user_spawn_thaws_total", "Frozen sessions thawed by activity, a login or being stopped."},
+    {"dinit_user_spawn_restarts_total", "User dinit processes restarted after crashing whilst their user was logged in."},
+    {"dinit_user_spawn_restart_give_ups_total", "Users left without a dinit after it crashed restart_attempts times in a row."},
+};
+
+std::array<histogram, (size_t)spawn_phase::count> histograms;
+std::array<uint64_t, (size_t)metrics_counter::count> counters = {};
+std::filesystem::path metrics_path;
+std::chrono::seconds write_interval;
+
+void write_histogram(std::ostream& out, const std::string& name, const std::string& labels, const histogram& data) {
+    std::string prefix = labels.empty() ? "{" : "{" + labels + ",";
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < bucket_bounds.size(); i++) {
+        cumulative += data.buckets[i];
+        out << name << "_bucket" << prefix << "le=\"" << bucket_bounds[i] << "\"} " << cumulative << '\n';
+    }
+    out << name << "_bucket" << prefix << "le=\"+Inf\"} " << data.count << '\n';
+    std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << suffix << ' ' << data.sum << '\n';
+    out << name << "_count" << suffix << ' ' << data.count << '\n';
+}
+
+void write_metrics() {
+    std::filesystem::path temporary = metrics_path;
+    temporary += ".tmp";
+
+    std::ofstream out(temporary, std::ios::trunc);
+    if (!out) {
+        log_error() << "Failed to write metrics: " << temporary.string();
+        return;
+    }
+
+    out << "# HELP dinit_user_spawn_phase_duration_seconds Time spent in each phase of spawning a user dinit process.\n"
+        << "# TYPE dinit_user_spawn_phase_duration_seconds histogram\n";
+    for (size_t i = 0; i < (size_t)spawn_phase::session_start; i++) {
+        write_histogram(out, "dinit_user_spawn_phase_duration_seconds", std::string("phase=\"") + phase_names[i] + "\"", histograms[i]);
+    }
+    out << "# HELP dinit_user_spawn_session_start_seconds Time from a login being seen to the user's dinit being exec'd.\n"
+        << "# TYPE dinit_user_spawn_session_start_seconds histogram\n";
+    write_histogram(out, "dinit_user_spawn_session_start_seconds", "", histograms[(size_t)spawn_phase::session_start]);
+    out << "# HELP dinit_user_spawn_session_stop_seconds Time from a logout being seen to the user's dinit having exited.\n"
+        << "# TYPE dinit_user_spawn_session_stop_seconds histogram\n";
+    write_histogram(out, "dinit_user_spawn_session_stop_seconds", "", histograms[(size_t)spawn_phase::session_stop]);
+    out << "# HELP dinit_user_spawn_session_ready_seconds Time from a user's dinit being exec'd to their boot service starting.\n"
+        << "# TYPE dinit_user_spawn_session_ready_seconds histogram\n";
+    write_histogram(out, "dinit_user_spawn_session_ready_seconds", "", histograms[(size_t)spawn_phase::session_ready]);
+
+    for (size_t i = 0; i < counters.size(); i++) {
+        out << "# HELP " << counter_infos[i].name << ' ' << counter_infos[i].help << '\n'
+            << "# TYPE " << counter_infos[i].name << " counter\n"
+            << counter_infos[i].name << ' ' << counters[i] << '\n';
+    }
+    out << "# HELP dinit_user_spawn_sessions Currently tracked user sessions.\n"
+        << "# TYPE dinit_user_spawn_sessions gauge\n"
+        << "dinit_user_spawn_sessions " << get_sessions().size() << '\n'
+        << "# HELP dinit_user_spawn_sessions_frozen Tracked sessions currently frozen for being idle.\n"
+        << "# TYPE dinit_user_spawn_sessions_frozen gauge\n"
+        << "dinit_user_spawn_sessions_frozen "
+        << std::count_if(get_sessions().begin(), get_sessions().end(), [](const auto& entry) { return entry.second.state == session_state::frozen; }) << '\n'
+        << "# HELP dinit_user_spawn_lazy_sessions_waiting Lazy sessions listening on their sockets, with no dinit yet.\n"
+        << "# TYPE dinit_user_spawn_lazy_sessions_waiting gauge\n"
+        << "dinit_user_spawn_lazy_sessions_waiting " << activation_waiting_uids().size() << '\n';
+
+    // Read from the cgroup files kept open for each session, so this costs two preads a session
+    std::ostringstream memory;
+    std::ostringstream cpu;
+    std::ostringstream ready;
+    for (const auto& [uid, tracked] : get_sessions()) {
+        if (tracked.time_to_ready.has_value()) {
+            ready << "dinit_user_spawn_session_time_to_ready_seconds{uid=\"" << uid << "\"} "
+                << std::chrono::duration<double>(tracked.time_to_ready.value()).count() << '\n';
+        }
+        std::optional<cgroup_stats> stats = tracked.in_cgroup ? cgroup_read_stats(uid) : std::nullopt;
+        if (stats.has_value()) {
+            memory << "dinit_user_spawn_session_memory_bytes{uid=\"" << uid << "\"} " << stats->memory_bytes << '\n';
+            cpu << "dinit_user_spawn_session_cpu_seconds_total{uid=\"" << uid << "\"} " << stats->cpu_usec / 1e6 << '\n';
+        }
+    }
+    out << "# HELP dinit_user_spawn_session_memory_bytes Memory used by everything in a session's cgroup.\n"
+        << "# TYPE dinit_user_spawn_session_memory_bytes gauge\n" << memory.str()
+        << "# HELP dinit_user_spawn_session_cpu_seconds_total CPU time used by everything in a session's cgroup.\n"
+        << "# TYPE dinit_user_spawn_session_cpu_seconds_total counter\n" << cpu.str()
+        << "# HELP dinit_user_spawn_session_time_to_ready_seconds How long each session's boot service took to start.\n"
+        << "# TYPE dinit_user_spawn_session_time_to_ready_seconds gauge\n" << ready.str();
+
+    out.close();
+    // Renamed into place, so the collector never reads a partial file
+    if (!out || rename(temporary.c_str(), metrics_path.c_str()) != 0) {
+        log_error() << "Failed to write metrics: " << metrics_path.string();
+    }
+}
+
+void write_periodically() {
+    write_metrics();
+    loop_schedule(write_interval, write_periodically);
+}
+
+} // namespace
+
+void metrics_observe(spawn_phase phase, std::chrono::steady_clock::duration duration) {
+    histogram& data = histograms[(size_t)phase];
+    double seconds = std::chrono::duration<double>(duration).count();
+    size_t bucket = 0;
+    while (bucket < bucket_bounds.size() && seconds > bucket_bounds[bucket]) {
+        bucket++;
+    }
+    if (bucket < bucket_bounds.size()) {
+        data.buckets[bucket]++;
+    }
+    data.count++;
+    data.sum += seconds;
+}
+
+void metrics_increment(metrics_counter counter, uint64_t amount) {
+    counters[(size_t)counter] += amount;
+}
+
+void metrics_start(const std::filesystem::path& path, std::chrono::seconds interval) {
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    metrics_path = path;
+    write_interval = interval;
+    write_periodically();
+}
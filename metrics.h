@@ -0,0 +1,43 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+
+// Spawn latency histograms and event counters, periodically written out in the Prometheus text format for the
+// node exporter textfile collector. All timings are taken from the monotonic clock.
+enum class spawn_phase {
+    passwd_lookup,
+    instance_check,
+    config_load,
+    fork,
+    privilege_drop,
+    exec,
+    session_start, // From handle_user being called to the user's dinit having been exec'd
+    session_stop, // From logout to the user's dinit having exited
+    session_ready, // From the user's dinit being exec'd to their boot service starting
+    count,
+};
+
+enum class metrics_counter {
+    spawns,
+    spawn_failures,
+    kills,
+    reaps,
+    inotify_events,
+    linger_resumes,
+    ready_failures,
+    activations,
+    freezes,
+    thaws,
+    restarts,
+    restart_give_ups,
+    count,
+};
+
+void metrics_observe(spawn_phase phase, std::chrono::steady_clock::duration duration);
+void metrics_increment(metrics_counter counter, uint64_t amount = 1);
+
+// Starts writing the metrics to path every interval, must be called after loop_init
+void metrics_start(const std::filesystem::path& path, std::chrono::seconds interval);
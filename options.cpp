@@ -0,0 +1,101 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "options.h"
+#include <cstdlib>
+#include <iostream>
+#include <optional>
+#include <string>
+
+daemon_options options;
+
+void print_usage(const char* program) {
+    std::cout << "Usage: " << program << " [options]\n"
+        << "  --monitored-path <path>\n"
+        << "                    Directory to watch for user runtime directories (default: /run/user)\n"
+        << "  --spawn-helper    Spawn user dinit processes from a pre-forked helper process\n"
+        << "  --config-cache-file <path>\n"
+        << "                    Persist parsed user configurations to path, such as /run/dinit-user-spawn/config-cache\n"
+        << "  --metrics-file <path>\n"
+        << "                    Periodically write Prometheus metrics to path, for the node exporter textfile collector\n"
+        << "  --metrics-interval <seconds>\n"
+        << "                    How often the metrics file is written (default: 15)\n"
+        << "  --control-socket <path>\n"
+        << "                    Where to create the control socket (default: " << default_control_socket.string() << ")\n"
+        << "  --no-control-socket\n"
+        << "                    Do not create a control socket\n"
+        << "  --state-file <path>\n"
+        << "                    Where tracked sessions are recorded, to adopt them after a restart (default: "
+        << options.state_file.string() << ")\n"
+        << "  --no-state-file   Do not record tracked sessions\n"
+        << "  --cgroup <path>   Place each session in a cgroup of its own under path, such as /sys/fs/cgroup/dinit-user-spawn\n"
+        << "  --passwd-file <path>\n"
+        << "                    Look users up in path, in the passwd(5) format, instead of through NSS\n"
+        << "  --log-level <debug|info|error>\n"
+        << "                    Least severe messages to log (default: info)\n"
+        << "  --help            Show this message" << std::endl;
+}
+
+std::optional<long> parse_positive(const std::string& value) {
+    try {
+        size_t end;
+        long parsed = std::stol(value, &end);
+        if (end == value.size() && parsed > 0) {
+            return parsed;
+        }
+    } catch (const std::exception& e) {}
+    return std::nullopt;
+}
+
+bool parse_options(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--monitored-path" && i + 1 < argc) {
+            options.monitored_path = argv[++i];
+        } else if (arg == "--spawn-helper") {
+            options.spawn_helper = true;
+        } else if (arg == "--config-cache-file" && i + 1 < argc) {
+            options.config_cache_file = argv[++i];
+        } else if (arg == "--metrics-file" && i + 1 < argc) {
+            options.metrics_file = argv[++i];
+        } else if (arg == "--metrics-interval" && i + 1 < argc) {
+            auto seconds = parse_positive(argv[++i]);
+            if (!seconds.has_value()) {
+                log_error() << "--metrics-interval must be a positive number of seconds!";
+                return false;
+            }
+            options.metrics_interval = std::chrono::seconds(seconds.value());
+        } else if (arg == "--control-socket" && i + 1 < argc) {
+            options.control_socket = argv[++i];
+        } else if (arg == "--no-control-socket") {
+            options.control_socket.clear();
+        } else if (arg == "--state-file" && i + 1 < argc) {
+            options.state_file = argv[++i];
+        } else if (arg == "--no-state-file") {
+            options.state_file.clear();
+        } else if (arg == "--cgroup" && i + 1 < argc) {
+            options.cgroup_root = argv[++i];
+        } else if (arg == "--passwd-file" && i + 1 < argc) {
+            options.passwd_file = argv[++i];
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            std::string level = argv[++i];
+            if (level == "debug") {
+                options.minimum_log_level = log_level::debug;
+            } else if (level == "info") {
+                options.minimum_log_level = log_level::info;
+            } else if (level == "error") {
+                options.minimum_log_level = log_level::error;
+            } else {
+                log_error() << "--log-level must be one of debug, info or error!";
+                return false;
+            }
+        } else if (arg == "--help") {
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        } else {
+            log_error() << "Unknown option: " << arg;
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
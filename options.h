@@ -0,0 +1,25 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <chrono>
+#include <filesystem>
+#include "control.h"
+#include "log.h"
+
+// Daemon wide options, set from the command line. Per user options live in the user's toml, see config.h.
+struct daemon_options {
+    std::filesystem::path monitored_path = "/run/user"; // Where logind creates each user's runtime directory
+    bool spawn_helper = false;
+    std::filesystem::path config_cache_file; // Empty if the config cache is kept in memory only
+    std::filesystem::path metrics_file; // Empty if metrics are not written out
+    std::chrono::seconds metrics_interval{15};
+    std::filesystem::path control_socket = default_control_socket; // Empty if disabled
+    std::filesystem::path state_file = "/run/dinit-user-spawn/sessions"; // Empty if disabled
+    log_level minimum_log_level = log_level::info;
+    std::filesystem::path cgroup_root; // Empty if sessions stay in the daemon's cgroup
+    std::filesystem::path passwd_file; // Empty to look users up through NSS
+};
+
+extern daemon_options options;
+
+bool parse_options(int argc, char** argv);
@@ -0,0 +1,218 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "passwd_cache.h"
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <unordered_map>
+#include <grp.h>
+#include <pwd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "loop.h"
+
+namespace {
+
+struct cache_entry {
+    std::optional<user_entry> entry;
+    std::chrono::steady_clock::time_point expiry;
+};
+
+struct lookup_result {
+    int uid;
+    std::optional<user_entry> entry;
+    bool failed; // The lookup itself failed, so nothing is known about the UID and it is not cached
+};
+
+// Only touched from the event loop
+std::unordered_map<int, cache_entry> cache;
+std::set<int> in_flight;
+passwd_callback on_resolved;
+std::filesystem::path passwd_path;
+
+// Shared with the worker
+std::mutex queue_mutex;
+std::condition_variable queue_ready;
+std::deque<int> requests;
+std::deque<lookup_result> results;
+bool worker_stopping = false;
+int event_fd = -1;
+std::vector<std::thread> workers;
+
+std::optional<user_entry> resolve(int uid, bool& failed) {
+    failed = false;
+    passwd entry;
+    passwd* result = nullptr;
+    long size_hint = sysconf(_SC_GETPW_R_SIZE_MAX);
+    std::vector<char> buffer(size_hint > 0 ? size_hint : 16384);
+
+    if (!passwd_path.empty()) {
+        FILE* file = fopen(passwd_path.c_str(), "re");
+        if (file == nullptr) {
+            log_error(uid) << "Failed to open " << passwd_path.string() << ": " << std::strerror(errno);
+            failed = true;
+            return std::nullopt;
+        }
+        while (fgetpwent_r(file, &entry, buffer.data(), buffer.size(), &result) == 0 && entry.pw_uid != (uid_t)uid) {
+            result = nullptr;
+        }
+        fclose(file);
+        if (result == nullptr) {
+            return std::nullopt;
+        }
+        return user_entry {entry.pw_uid, entry.pw_gid, entry.pw_name, entry.pw_dir, entry.pw_shell, {entry.pw_gid}};
+    }
+
+    int error;
+    while ((error = getpwuid_r(uid, &entry, buffer.data(), buffer.size(), &result)) == ERANGE) {
+        buffer.resize(buffer.size() * 2);
+    }
+    if (result == nullptr) {
+        // No error means there is simply no such user, which is worth remembering
+        if (error != 0) {
+            log_error(uid) << "Passwd lookup failed: " << std::strerror(error);
+            failed = true;
+        }
+        return std::nullopt;
+    }
+
+    user_entry user = {entry.pw_uid, entry.pw_gid, entry.pw_name, entry.pw_dir, entry.pw_shell, {}};
+    int group_count = 32;
+    user.groups.resize(group_count);
+    while (getgrouplist(entry.pw_name, entry.pw_gid, user.groups.data(), &group_count) == -1) {
+        user.groups.resize(group_count);
+    }
+    user.groups.resize(group_count);
+    return user;
+}
+
+void worker_main() {
+    while (true) {
+        int uid;
+        {
+            std::unique_lock lock(queue_mutex);
+            queue_ready.wait(lock, [] { return !requests.empty() || worker_stopping; });
+            if (worker_stopping) {
+                return;
+            }
+            uid = requests.front();
+            requests.pop_front();
+        }
+        bool failed;
+        std::optional<user_entry> entry = resolve(uid, failed);
+        {
+            std::lock_guard lock(queue_mutex);
+            results.push_back({uid, std::move(entry), failed});
+        }
+        uint64_t one = 1;
+        while (write(event_fd, &one, sizeof(one)) == -1 && errno == EINTR) {}
+    }
+}
+
+void worker_stop() {
+    {
+        std::lock_guard lock(queue_mutex);
+        worker_stopping = true;
+    }
+    queue_ready.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join(); // Waits out a lookup in progress, which NSS bounds with its own timeouts
+    }
+}
+
+void store(const lookup_result& result) {
+    if (!result.failed) {
+        auto ttl = result.entry.has_value() ? passwd_positive_ttl : passwd_negative_ttl;
+        cache[result.uid] = {result.entry, std::chrono::steady_clock::now() + ttl};
+    }
+}
+
+void handle_results() {
+    uint64_t count;
+    while (read(event_fd, &count, sizeof(count)) == -1 && errno == EINTR) {}
+
+    std::deque<lookup_result> resolved;
+    {
+        std::lock_guard lock(queue_mutex);
+        resolved.swap(results);
+    }
+    for (const lookup_result& result : resolved) {
+        in_flight.erase(result.uid);
+        store(result);
+        on_resolved(result.uid, result.entry);
+    }
+}
+
+const cache_entry* find_cached(int uid) {
+    auto it = cache.find(uid);
+    if (it == cache.end()) {
+        return nullptr;
+    }
+    if (it->second.expiry <= std::chrono::steady_clock::now()) {
+        cache.erase(it);
+        return nullptr;
+    }
+    return &it->second;
+}
+
+} // namespace
+
+bool passwd_cache_start(passwd_callback callback, const std::filesystem::path& passwd_file) {
+    on_resolved = std::move(callback);
+    passwd_path = passwd_file;
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) {
+        log_error() << "Failed to create the passwd eventfd: " << std::strerror(errno);
+        return false;
+    }
+    for (size_t i = 0; i < passwd_workers; i++) {
+        workers.emplace_back(worker_main);
+    }
+    std::atexit(worker_stop);
+    loop_add(event_fd, EPOLLIN, [](uint32_t) { handle_results(); });
+    return true;
+}
+
+void passwd_lookup(int uid) {
+    if (const cache_entry* cached = find_cached(uid)) {
+        on_resolved(uid, cached->entry);
+        return;
+    }
+    if (event_fd == -1) {
+        // Without the worker, all that is left is to block
+        on_resolved(uid, passwd_lookup_blocking(uid));
+        return;
+    }
+    if (!in_flight.insert(uid).second) {
+        return;
+    }
+    {
+        std::lock_guard lock(queue_mutex);
+        requests.push_back(uid);
+    }
+    queue_ready.notify_one();
+}
+
+std::optional<user_entry> passwd_lookup_blocking(int uid) {
+    if (const cache_entry* cached = find_cached(uid)) {
+        return cached->entry;
+    }
+    bool failed;
+    lookup_result result = {uid, resolve(uid, failed), false};
+    result.failed = failed;
+    store(result);
+    return result.entry;
+}
+
+void passwd_cache_clear() {
+    cache.clear();
+}
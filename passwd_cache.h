@@ -0,0 +1,42 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// Passwd and group lookups go through NSS, which on directory backed hosts (SSSD, LDAP) can take a long time. They
+// are resolved by a small pool of worker threads instead, and delivered back to the event loop through an eventfd, so a
+// slow lookup only delays the user it is for, unless every worker is stuck on one. Results are cached, including UIDs
+// with no entry, for a while.
+
+// Everything needed of a user's passwd and group entries, copied out of NSS' buffers
+struct user_entry {
+    uid_t uid;
+    gid_t gid;
+    std::string name;
+    std::string home;
+    std::string shell;
+    std::vector<gid_t> groups; // Supplementary groups, including gid
+};
+
+const std::chrono::seconds passwd_positive_ttl{300};
+const std::chrono::seconds passwd_negative_ttl{30};
+const size_t passwd_workers = 8; // Lookups in progress at once, each for a different UID
+
+// Called from the event loop once a lookup has resolved, with nullopt if the UID has no passwd entry
+using passwd_callback = std::function<void(int uid, std::optional<user_entry> entry)>;
+
+// If passwd_file is not empty, users are looked up in it (in the passwd(5) format) instead of through NSS, with
+// only their primary group. This stands in for a real directory when testing.
+bool passwd_cache_start(passwd_callback callback, const std::filesystem::path& passwd_file);
+// Calls back straight away if the UID is cached, otherwise once a worker has resolved it. Lookups for a UID which
+// is already being resolved are merged into that one.
+void passwd_lookup(int uid);
+// Resolves on the calling thread, for use before the event loop is running
+std::optional<user_entry> passwd_lookup_blocking(int uid);
+void passwd_cache_clear();
@@ -0,0 +1,205 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "process_index.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+struct indexed_process {
+    int uid;
+    bool spawned_by_us; // Our own children are tracked through reap events, external ones are revalidated on lookup
+};
+
+std::unordered_map<pid_t, indexed_process> processes;
+std::unordered_map<int, std::vector<pid_t>> uid_processes;
+std::chrono::steady_clock::time_point last_scan;
+
+// Dinit instances started by some other method are only visible through /proc. Rather than walking it on every
+// login, a lookup miss triggers a rescan at most this often. The cost is that a dinit the user started themselves within
+// this long of the last scan is not seen, so logging in just then spawns a second one for them. That second one then
+// runs alongside theirs until logout, as it would have if they had started theirs just after we spawned.
+const std::chrono::milliseconds rescan_interval{1000};
+
+// Read a small /proc file into buffer, returns the number of bytes read or -1
+ssize_t read_proc_file(const char* path, char* buffer, size_t size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) { return -1; }
+    ssize_t length = read(fd, buffer, size - 1);
+    close(fd);
+    if (length >= 0) { buffer[length] = '\0'; }
+    return length;
+}
+
+// Returns the effective UID of pid if its command name is exactly dinit (the equivalent of pgrep -x), otherwise -1
+int dinit_owner(pid_t pid) {
+    char path[64];
+    char buffer[1024];
+
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+    if (read_proc_file(path, buffer, sizeof(buffer)) <= 0 || strcmp(buffer, "dinit\n") != 0) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if (read_proc_file(path, buffer, sizeof(buffer)) <= 0) {
+        return -1;
+    }
+    const char* uid_line = strstr(buffer, "\nUid:");
+    if (uid_line == nullptr) {
+        return -1;
+    }
+    // Uid: <real> <effective> <saved> <filesystem>, pgrep -u matches on the effective UID
+    char* end = nullptr;
+    strtol(uid_line + 5, &end, 10);
+    return (int)strtol(end, nullptr, 10);
+}
+
+void insert(int uid, pid_t pid, bool spawned_by_us) {
+    auto [it, inserted] = processes.insert({pid, {uid, spawned_by_us}});
+    if (!inserted) {
+        if (it->second.uid == uid) {
+            it->second.spawned_by_us |= spawned_by_us;
+            return;
+        }
+        process_index_remove(pid);
+        processes.insert({pid, {uid, spawned_by_us}});
+    }
+    uid_processes[uid].push_back(pid);
+}
+
+} // namespace
+
+void process_index_scan() {
+    last_scan = std::chrono::steady_clock::now();
+
+    DIR* proc = opendir("/proc");
+    if (proc == nullptr) {
+        return;
+    }
+    while (dirent* entry = readdir(proc)) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+        pid_t pid = (pid_t)strtol(entry->d_name, nullptr, 10);
+        int uid = dinit_owner(pid);
+        if (uid != -1) {
+            insert(uid, pid, false);
+        }
+    }
+    closedir(proc);
+}
+
+void process_index_add(int uid, pid_t pid) {
+    insert(uid, pid, true);
+}
+
+void process_index_remove(pid_t pid) {
+    auto it = processes.find(pid);
+    if (it == processes.end()) {
+        return;
+    }
+    auto uid_it = uid_processes.find(it->second.uid);
+    if (uid_it != uid_processes.end()) {
+        std::erase(uid_it->second, pid);
+        if (uid_it->second.empty()) {
+            uid_processes.erase(uid_it);
+        }
+    }
+    processes.erase(it);
+}
+
+std::optional<pid_t> process_index_find(int uid) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        auto uid_it = uid_processes.find(uid);
+        if (uid_it != uid_processes.end()) {
+            // Copy, as stale entries are removed whilst iterating
+            std::vector<pid_t> candidates = uid_it->second;
+            for (pid_t pid : candidates) {
+                if (processes.at(pid).spawned_by_us || dinit_owner(pid) == uid) {
+                    return pid;
+                }
+                process_index_remove(pid);
+            }
+        }
+
+        if (std::chrono::steady_clock::now() - last_scan < rescan_interval) {
+            break;
+        }
+        process_index_scan();
+    }
+    return std::nullopt;
+}
+
+std::optional<unsigned long long> process_start_time(pid_t pid) {
+    char path[64];
+    char buffer[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    if (read_proc_file(path, buffer, sizeof(buffer)) <= 0) {
+        return std::nullopt;
+    }
+    // Field 22, counting from the state field which is the first after comm
+    const char* after_comm = strrchr(buffer, ')');
+    unsigned long long start_time;
+    if (after_comm == nullptr || sscanf(after_comm + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu", &start_time) != 1) {
+        return std::nullopt;
+    }
+    return start_time;
+}
+
+std::unordered_map<pid_t, std::vector<pid_t>> process_children() {
+    std::unordered_map<pid_t, std::vector<pid_t>> children;
+    DIR* proc = opendir("/proc");
+    if (proc == nullptr) {
+        return children;
+    }
+    char path[64];
+    char buffer[1024];
+    while (dirent* entry = readdir(proc)) {
+        if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+            continue;
+        }
+        pid_t pid = (pid_t)strtol(entry->d_name, nullptr, 10);
+        snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+        if (read_proc_file(path, buffer, sizeof(buffer)) <= 0) {
+            continue;
+        }
+        // pid (comm) state ppid ..., where comm may itself contain spaces or parentheses
+        const char* after_comm = strrchr(buffer, ')');
+        if (after_comm == nullptr) {
+            continue;
+        }
+        pid_t parent = 0;
+        if (sscanf(after_comm + 1, " %*c %d", &parent) == 1) {
+            children[parent].push_back(pid);
+        }
+    }
+    closedir(proc);
+    return children;
+}
+
+std::vector<pid_t> process_descendants(const std::unordered_map<pid_t, std::vector<pid_t>>& children, pid_t root) {
+    std::vector<pid_t> descendants;
+    std::vector<pid_t> pending = {root};
+    while (!pending.empty()) {
+        pid_t pid = pending.back();
+        pending.pop_back();
+        auto it = children.find(pid);
+        if (it == children.end()) {
+            continue;
+        }
+        for (pid_t child : it->second) {
+            descendants.push_back(child);
+            pending.push_back(child);
+        }
+    }
+    return descendants;
+}
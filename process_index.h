@@ -0,0 +1,23 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include <sys/types.h>
+
+// In-process index of running dinit processes, keyed by UID. It is seeded by a single /proc scan, and then kept
+// current by our own spawn and reap events, so checking for an existing instance never has to shell out to pgrep.
+void process_index_scan();
+void process_index_add(int uid, pid_t pid);
+void process_index_remove(pid_t pid);
+std::optional<pid_t> process_index_find(int uid);
+
+// The start time of pid in clock ticks since boot, which together with the PID uniquely identifies a process
+std::optional<unsigned long long> process_start_time(pid_t pid);
+
+// Maps every running process to its children, from a single /proc scan. Scanning once and then walking the map for
+// each tree is what lets a batch of teardowns share the cost.
+std::unordered_map<pid_t, std::vector<pid_t>> process_children();
+// All descendants of root, excluding root itself
+std::vector<pid_t> process_descendants(const std::unordered_map<pid_t, std::vector<pid_t>>& children, pid_t root);
@@ -0,0 +1,929 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "session.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <optional>
+#include <set>
+#include <string>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "activation.h"
+#include "cgroup.h"
+#include "config.h"
+#include "config_cache.h"
+#include "idle.h"
+#include "log.h"
+#include "loop.h"
+#include "metrics.h"
+#include "options.h"
+#include "passwd_cache.h"
+#include "process_index.h"
+#include "spawn.h"
+#include "spawn_helper.h"
+#include "state_file.h"
+
+namespace {
+
+// Called directly, as not every libc provides a usable wrapper for this yet
+int pidfd_send_signal(int pidfd, int sig, siginfo_t* info, unsigned int flags) {
+    return (int)syscall(SYS_pidfd_send_signal, pidfd, sig, info, flags);
+}
+
+std::map<int, session> sessions; // Keyed by UID
+std::unordered_map<pid_t, int> pid_uids;
+struct pending_spawn {
+    std::chrono::steady_clock::time_point handling_start;
+    configuration config;
+    bool in_cgroup;
+    int ready_fd; // See open_ready_fifo
+};
+struct generating_config {
+    pid_t pid;
+    int pidfd;
+    std::chrono::steady_clock::time_point handling_start;
+    user_entry user;
+    configuration config;
+};
+
+std::map<int, std::chrono::steady_clock::time_point> resolving; // Awaiting their passwd entry, from when handling started
+std::map<int, pending_spawn> pending_spawns; // Submitted to the spawn helper, awaiting its reply
+std::map<int, generating_config> generating; // Their configuration is being generated, before they are spawned
+std::set<int> pending_logouts; // Logged out whilst their spawn was pending
+std::map<int, restart_backoff> restarts; // Keyed by UID
+std::vector<int> escalations; // UIDs whose stop_timeout has passed, killed together in one batch
+const std::chrono::seconds helper_status_timeout{1};
+
+// Not a pidfd_open wrapper in every libc yet either
+int pidfd_open(pid_t pid, unsigned int flags) {
+    return (int)syscall(SYS_pidfd_open, pid, flags);
+}
+
+void write_state(std::ostream& out) {
+    for (const auto& [uid, tracked] : sessions) {
+        out << uid << ' ' << tracked.pid << ' ' << tracked.proc_start_time << '\n';
+    }
+}
+
+state_file session_state_file = {"session state", write_state, {}, false};
+
+void schedule_state_write() {
+    state_file_schedule_write(session_state_file);
+}
+
+std::filesystem::path ready_fifo_path(int uid) {
+    return options.monitored_path / std::to_string(uid) / ready_fifo_name;
+}
+
+// The fifo the ready_service writes to once boot has started. It is created by us, and only trusted once opened and
+// seen to be that same fifo, whatever the user has placed in their runtime directory. It is opened for writing too,
+// so that it never reads as closed, however many writers come and go.
+int open_ready_fifo(const user_entry& user) {
+    std::filesystem::path path = ready_fifo_path(user.uid);
+    unlink(path.c_str()); // Left over from an earlier session
+    if (mkfifo(path.c_str(), 0600) == -1) {
+        log_error(user.uid) << "Failed to create " << path.string() << ": " << std::strerror(errno);
+        return -1;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+    struct stat info;
+    if (fd == -1 || fstat(fd, &info) == -1 || !S_ISFIFO(info.st_mode) || info.st_uid != 0 || info.st_nlink != 1
+        || fchown(fd, user.uid, user.gid) == -1) {
+        log_error(user.uid) << "Failed to open " << path.string() << ": " << std::strerror(errno);
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+void close_ready_fifo(int uid, int fd) {
+    if (fd != -1) {
+        close(fd);
+        unlink(ready_fifo_path(uid).c_str());
+    }
+}
+
+void stop_waiting_for_ready(session& tracked) {
+    loop_cancel(tracked.ready_timer);
+    tracked.ready_timer = 0;
+    if (tracked.ready_fd != -1) {
+        loop_remove(tracked.ready_fd);
+        close_ready_fifo(tracked.uid, tracked.ready_fd);
+        tracked.ready_fd = -1;
+    }
+}
+
+void ready_failed(session& tracked, const std::string& reason) {
+    log_error(tracked.uid, tracked.pid) << "dinit process " << reason << "!";
+    tracked.readiness = session_readiness::failed;
+    metrics_increment(metrics_counter::ready_failures);
+    stop_waiting_for_ready(tracked);
+}
+
+// Any data means boot has started. As we hold a write end ourselves, there is never an EOF.
+void session_ready_fd_event(int uid) {
+    auto it = sessions.find(uid);
+    if (it == sessions.end() || it->second.ready_fd == -1) {
+        return;
+    }
+    session& tracked = it->second;
+    char buffer[64];
+    ssize_t length = read(tracked.ready_fd, buffer, sizeof(buffer));
+    if (length <= 0) {
+        return;
+    }
+    tracked.time_to_ready = std::chrono::steady_clock::now() - tracked.start_time;
+    tracked.readiness = session_readiness::ready;
+    metrics_observe(spawn_phase::session_ready, tracked.time_to_ready.value());
+    auto ready_time = std::chrono::duration_cast<std::chrono::milliseconds>(tracked.time_to_ready.value());
+    log_info(uid, tracked.pid) << "Their boot service started after " << ready_time.count() << "ms";
+    stop_waiting_for_ready(tracked);
+}
+
+void untrack_session(std::map<int, session>::iterator it) {
+    if (it->second.readiness == session_readiness::waiting) {
+        ready_failed(it->second, "exited before its boot service started");
+    }
+    loop_cancel(it->second.stop_timer);
+    loop_cancel(it->second.linger_timer);
+    loop_cancel(it->second.status_timer);
+    idle_untrack(it->first);
+    loop_remove(it->second.pidfd);
+    close(it->second.pidfd);
+    pid_uids.erase(it->second.pid);
+    if (it->second.in_cgroup) {
+        cgroup_release(it->first);
+    }
+    sessions.erase(it);
+    schedule_state_write();
+}
+
+// Called once the pidfd of a session becomes readable, which happens as soon as the process exits
+void session_pidfd_ready(int uid) {
+    auto it = sessions.find(uid);
+    if (it == sessions.end()) {
+        return;
+    }
+    siginfo_t info = {};
+    if (waitid(P_PIDFD, it->second.pidfd, &info, WEXITED | WNOHANG) == -1) {
+        if (errno != ECHILD) {
+            log_error() << "waitid on pidfd failed: " << std::strerror(errno);
+        }
+        if (it->second.reaped_by_helper && spawn_helper_running()) {
+            // The helper sends the status it reaped it with, which decides whether it crashed. Should that never
+            // arrive, the exit is still recorded, without one.
+            loop_remove(it->second.pidfd);
+            int pidfd = it->second.pidfd;
+            it->second.status_timer = loop_schedule(helper_status_timeout, [uid, pidfd] {
+                // Keyed by the pidfd, which stays open whilst the session is tracked, so a recycled PID is never mistaken
+                auto it = sessions.find(uid);
+                if (it != sessions.end() && it->second.pidfd == pidfd) {
+                    it->second.status_timer = 0;
+                    handle_reaped(it->second.pid, std::nullopt);
+                }
+            });
+            return;
+        }
+        // Not our child (such as one adopted after a restart), or already reaped elsewhere, so the exit is all that is
+        // left to record
+        handle_reaped(it->second.pid, std::nullopt);
+        return;
+    }
+    if (info.si_pid == 0) {
+        return; // Not exited yet
+    }
+    int status = info.si_code == CLD_EXITED ? W_EXITCODE(info.si_status, 0) : info.si_status;
+    handle_reaped(info.si_pid, status);
+}
+
+void thaw_session(session& tracked, const char* reason) {
+    if (!cgroup_freeze(tracked.uid, false)) {
+        log_error(tracked.uid, tracked.pid) << "Failed to thaw their cgroup: " << std::strerror(errno);
+    }
+    tracked.state = session_state::running;
+    idle_reset(tracked.uid);
+    metrics_increment(metrics_counter::thaws);
+    log_info(tracked.uid, tracked.pid) << reason << ", thawed their dinit";
+}
+
+void schedule_restart(int uid, const configuration& config, std::chrono::steady_clock::duration ran_for) {
+    restart_backoff& backoff = restarts[uid];
+    if (ran_for >= restart_stable_after) {
+        backoff.crashes = 0;
+    }
+    backoff.crashes++;
+    if (backoff.crashes > config.restart_attempts) {
+        if (config.restart_attempts > 0) {
+            log_error(uid) << "dinit process crashed " << backoff.crashes << " times in a row, not restarting it until they log in again!";
+            metrics_increment(metrics_counter::restart_give_ups);
+        }
+        restarts.erase(uid);
+        return;
+    }
+
+    // Doubled for each crash in a row before this one, stopping at the cap rather than overflowing on the way
+    std::chrono::seconds delay(config.restart_delay);
+    for (int i = 1; i < backoff.crashes && delay < max_restart_backoff; i++) {
+        delay *= 2;
+    }
+    delay = std::min(delay, max_restart_backoff);
+    backoff.due = std::chrono::steady_clock::now() + delay;
+    backoff.timer = loop_schedule(delay, [uid] {
+        auto it = restarts.find(uid);
+        if (it == restarts.end()) {
+            return;
+        }
+        it->second.timer = 0;
+        metrics_increment(metrics_counter::restarts);
+        log_info(uid) << "Restarting their dinit";
+        handle_user(uid);
+    });
+    log_info(uid) << "dinit process crashed whilst they are logged in, restarting it in " << delay.count() << "s (attempt "
+        << backoff.crashes << " of " << config.restart_attempts << ")";
+}
+
+void record_spawn_timings(const spawn_timings& timings, std::chrono::steady_clock::time_point handling_start) {
+    metrics_observe(spawn_phase::fork, timings.fork);
+    metrics_observe(spawn_phase::privilege_drop, timings.privilege_drop);
+    metrics_observe(spawn_phase::exec, timings.exec);
+    metrics_observe(spawn_phase::session_start, std::chrono::steady_clock::now() - handling_start);
+    metrics_increment(metrics_counter::spawns);
+}
+
+// SIGKILLs the whole process tree of every session whose stop_timeout passed in this loop iteration. The tree is
+// collected before anything is killed, as orphaned descendants would be reparented away from it.
+void kill_escalated() {
+    std::optional<std::unordered_map<pid_t, std::vector<pid_t>>> children;
+    std::vector<int> batch;
+    batch.swap(escalations);
+
+    for (int uid : batch) {
+        auto it = sessions.find(uid);
+        if (it == sessions.end() || it->second.state != session_state::stopping) {
+            continue;
+        }
+        // A cgroup takes its whole tree down at once, including anything that escaped being dinit's descendant
+        if (it->second.in_cgroup && cgroup_kill(uid)) {
+            log_error(uid, it->second.pid) << "dinit process did not stop within " << it->second.config.stop_timeout
+                << "s, killing everything in its cgroup!";
+            metrics_increment(metrics_counter::kills);
+            continue;
+        }
+        if (!children.has_value()) {
+            children = process_children();
+        }
+        std::vector<pid_t> descendants = process_descendants(children.value(), it->second.pid);
+        log_error(uid, it->second.pid) << "dinit process did not stop within " << it->second.config.stop_timeout
+            << "s, killing it and " << descendants.size() << " descendants!";
+
+        // dinit first, so that it cannot restart the services being killed
+        if (pidfd_send_signal(it->second.pidfd, SIGKILL, nullptr, 0) == 0) {
+            metrics_increment(metrics_counter::kills);
+        }
+        for (pid_t pid : descendants) {
+            if (kill(pid, SIGKILL) == 0) {
+                metrics_increment(metrics_counter::kills);
+            }
+        }
+    }
+}
+
+void escalate_stop(int uid) {
+    auto it = sessions.find(uid);
+    if (it == sessions.end()) {
+        return;
+    }
+    it->second.stop_timer = 0;
+    if (escalations.empty()) {
+        loop_defer(kill_escalated);
+    }
+    escalations.push_back(uid);
+}
+
+// The configuration a session is tracked with when it is not spawned by us, so has no resolved configuration
+configuration lookup_config(int uid) {
+    std::optional<user_entry> user = passwd_lookup_blocking(uid);
+    if (!user.has_value()) {
+        return configuration {};
+    }
+    bool config_exists = false;
+    return load_user_config(uid, user->home, config_exists).value_or(configuration {});
+}
+
+// ready_fd is from open_ready_fifo, or -1 if boot is not being waited on
+void track_session(int uid, pid_t pid, int pidfd, const configuration& config, bool in_cgroup, int ready_fd) {
+    process_index_add(uid, pid);
+    session tracked = {};
+    tracked.uid = uid;
+    tracked.pid = pid;
+    tracked.pidfd = pidfd;
+    tracked.start_time = std::chrono::steady_clock::now();
+    tracked.state = session_state::running;
+    tracked.config = config;
+    tracked.in_cgroup = in_cgroup;
+    tracked.proc_start_time = process_start_time(pid).value_or(0);
+    tracked.ready_fd = ready_fd;
+    tracked.readiness = ready_fd == -1 ? session_readiness::not_requested : session_readiness::waiting;
+    if (ready_fd != -1) {
+        loop_add(ready_fd, EPOLLIN, [uid](uint32_t) { session_ready_fd_event(uid); });
+        tracked.ready_timer = loop_schedule(std::chrono::seconds(config.ready_timeout), [uid] {
+            auto it = sessions.find(uid);
+            if (it != sessions.end()) {
+                it->second.ready_timer = 0;
+                ready_failed(it->second, "did not start its boot service within " + std::to_string(it->second.config.ready_timeout) + "s");
+            }
+        });
+    }
+    sessions.insert({uid, tracked});
+    schedule_state_write();
+    pid_uids.insert({pid, uid});
+    loop_add(pidfd, EPOLLIN, [uid](uint32_t) { session_pidfd_ready(uid); });
+    if (in_cgroup && config.freeze_after > 0) {
+        idle_track(uid, options.monitored_path / std::to_string(uid), std::chrono::seconds(config.freeze_after));
+    }
+}
+
+} // namespace
+
+const char* session_state_name(session_state state) {
+    switch (state) {
+    case session_state::running: return "running";
+    case session_state::lingering: return "lingering";
+    case session_state::frozen: return "frozen";
+    case session_state::stopping: return "stopping";
+    }
+    return "unknown";
+}
+
+const char* session_readiness_name(session_readiness readiness) {
+    switch (readiness) {
+    case session_readiness::not_requested: return "not_requested";
+    case session_readiness::waiting: return "waiting";
+    case session_readiness::ready: return "ready";
+    case session_readiness::failed: return "failed";
+    }
+    return "unknown";
+}
+
+const std::map<int, session>& get_sessions() {
+    return sessions;
+}
+
+const std::map<int, restart_backoff>& get_restarts() {
+    return restarts;
+}
+
+bool is_restart_pending(int uid) {
+    auto it = restarts.find(uid);
+    return it != restarts.end() && it->second.timer != 0;
+}
+
+std::string get_env_var(const std::string& var) {
+    const char* val = std::getenv(var.c_str());
+    return val ? std::string(val) : std::string{};
+}
+
+// MUST RUN AS ROOT, GETS ENV VARS FOR SPECIFIED USER
+std::unordered_map<std::string, std::string> get_env_vars(const user_entry& user) {
+    std::unordered_map<std::string, std::string> env_vars;
+    env_vars.insert({"XDG_RUNTIME_DIR", (options.monitored_path / std::to_string(user.uid)).string()}); // Arbitrary env var we need
+    env_vars.insert({"PATH", "/usr/bin/"}); // Arbitrary, but most people will probably use this. Potentially remove in future.
+    env_vars.insert({"SHELL", user.shell});
+    env_vars.insert({"HOME", user.home});
+    env_vars.insert({"LOGNAME", user.name});
+
+    return env_vars;
+}
+
+// The rest of handling a login, once their configuration is in place
+void spawn_user(int uid, const user_entry& user, const configuration& user_config,
+    std::chrono::steady_clock::time_point handling_start) {
+    // Lazy sessions listen on their sockets instead, and are handled again once one of them is connected to
+    std::optional<activation_sockets> activated = activation_take(uid);
+    if (activated.has_value()) {
+        metrics_increment(metrics_counter::activations);
+    } else if (user_config.lazy && !user_config.lazy_sockets.empty()) {
+        if (activation_listen(user, options.monitored_path / std::to_string(uid), user_config.lazy_sockets, handle_user)) {
+            return;
+        }
+        log_error(uid) << "Failed to listen on their sockets, spawning straight away!";
+    }
+
+    // Resolve everything the child needs now, so it only has to drop privileges and exec
+    spawn_request request = {};
+    request.uid = user.uid;
+    request.gid = user.gid;
+    request.groups = user.groups;
+
+    for (const auto& pair: get_env_vars(user)) {
+        request.environment.push_back(pair.first + "=" + pair.second);
+        if (user_config.verbose_debug) {
+            log_info(uid) << "Environment: " << request.environment.back();
+        }
+    }
+
+    if (activated.has_value()) {
+        std::string names;
+        for (const std::string& name : activated->names) {
+            names += (names.empty() ? "" : ":") + name;
+        }
+        request.environment.push_back("LISTEN_FDS=" + std::to_string(activated->fds.size()));
+        request.environment.push_back("LISTEN_FDNAMES=" + names);
+        request.listen_fds = activated->fds;
+    }
+
+    // Run the dinit process, using the user's specified binary
+    request.program = user_config.binary;
+    request.arguments.push_back(request.program); // First arg must be program name
+    for (auto& arg : user_config.arguments) {
+        request.arguments.push_back(arg);
+        if (user_config.verbose_debug) {
+            log_info(uid) << "Added dinit arg: " << arg;
+        }
+    }
+
+    if (cgroups_enabled()) {
+        std::optional<std::filesystem::path> cgroup_procs = cgroup_prepare(uid, user_config);
+        if (cgroup_procs.has_value()) {
+            request.cgroup_procs = cgroup_procs->string();
+        } else {
+            log_error(uid) << "Spawning without a cgroup, so their limits will not apply!";
+        }
+    }
+    bool in_cgroup = !request.cgroup_procs.empty();
+
+    int ready_fd = -1;
+    if (user_config.ready_timeout > 0) {
+        ready_fd = open_ready_fifo(user);
+    }
+
+    // The helper is only sent requests, not fds, so spawns which pass sockets are done here
+    if (spawn_helper_running() && request.listen_fds.empty()) {
+        pending_spawns.insert({uid, {handling_start, user_config, in_cgroup, ready_fd}});
+        spawn_helper_submit(uid, request);
+        return;
+    }
+
+    auto spawn_start = std::chrono::steady_clock::now();
+    std::optional<spawned_process> spawned = spawn_process(request);
+    for (int fd : request.listen_fds) {
+        close(fd); // Their dinit has its own copies now
+    }
+    if (!spawned.has_value()) {
+        log_error(uid) << "Failed to spawn " << request.program << "!";
+        metrics_increment(metrics_counter::spawn_failures);
+        if (in_cgroup) {
+            cgroup_release(uid);
+        }
+        close_ready_fifo(uid, ready_fd);
+        return;
+    }
+    auto spawn_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - spawn_start);
+    log_info(uid, spawned->pid) << "Running as: " << user.name << ", spawned in " << spawn_time.count() << "us";
+    record_spawn_timings(spawned->timings, handling_start);
+
+    track_session(uid, spawned->pid, spawned->pidfd, user_config, in_cgroup, ready_fd);
+}
+
+// Once their configuration has been generated, whether seen through its pidfd or reaped on SIGCHLD first. Without a
+// status, it was reaped elsewhere, and they are spawned regardless as when it fails.
+void generation_finished(int uid, std::optional<int> status) {
+    auto finished = generating.extract(uid);
+    if (finished.empty()) {
+        return;
+    }
+    generating_config& generated = finished.mapped();
+    loop_remove(generated.pidfd);
+    close(generated.pidfd);
+    if (status.has_value() && (!WIFEXITED(status.value()) || WEXITSTATUS(status.value()) != EXIT_SUCCESS)) {
+        log_error(uid) << "Failed to create / regenerate the configuration directory!";
+    }
+    if (pending_logouts.erase(uid) > 0) {
+        log_info(uid) << "Logged out whilst their configuration was generated, not spawning";
+        activation_cancel(uid);
+        return;
+    }
+    spawn_user(uid, generated.user, generated.config, generated.handling_start);
+}
+
+void generation_pidfd_ready(int uid) {
+    auto it = generating.find(uid);
+    if (it == generating.end()) {
+        return;
+    }
+    siginfo_t info = {};
+    if (waitid(P_PIDFD, it->second.pidfd, &info, WEXITED | WNOHANG) == -1) {
+        generation_finished(uid, std::nullopt);
+        return;
+    }
+    if (info.si_pid == 0) {
+        return; // Not exited yet
+    }
+    generation_finished(uid, info.si_code == CLD_EXITED ? W_EXITCODE(info.si_status, 0) : info.si_status);
+}
+
+// Generates any missing pieces of the user's configuration, or with generate_ready_service_option the service which
+// reports their boot. This is done as the user, to ensure everything has the correct permissions, by this same binary
+// spawned as them, so their home is never touched on the event loop. Returns false if it could not be spawned, in
+// which case they are spawned without it.
+bool generate_config_as_user(const user_entry& user, const std::string& what, const configuration& config,
+    std::chrono::steady_clock::time_point handling_start) {
+    spawn_request request = {};
+    request.uid = user.uid;
+    request.gid = user.gid;
+    request.groups = user.groups;
+    request.program = "/proc/self/exe"; // Still us, even once the binary has been replaced by an upgrade
+    request.arguments = {"dinit-user-spawn", what, user.home};
+    std::optional<spawned_process> spawned = spawn_process(request);
+    if (!spawned.has_value()) {
+        log_error(user.uid) << "Failed to spawn the generation of their configuration!";
+        return false;
+    }
+    int uid = user.uid;
+    generating.insert({uid, {spawned->pid, spawned->pidfd, handling_start, user, config}});
+    loop_add(spawned->pidfd, EPOLLIN, [uid](uint32_t) { generation_pidfd_ready(uid); });
+    return true;
+}
+
+void handle_user(int uid) {
+    log_debug(uid) << "Handling login";
+
+    if (is_spawn_pending(uid)) {
+        // Back before their spawn even finished, so it should no longer be cleaned up once it has
+        pending_logouts.erase(uid);
+        return;
+    }
+    auto tracked = sessions.find(uid);
+    if (tracked != sessions.end()) {
+        if (tracked->second.state == session_state::stopping) {
+            log_info(uid) << "Logged back in whilst their dinit is stopping, respawning once it has";
+            tracked->second.respawn_on_exit = true;
+        } else if (tracked->second.state == session_state::lingering) {
+            log_info(uid, tracked->second.pid) << "Logged back in within the linger window, keeping their dinit process";
+            loop_cancel(tracked->second.linger_timer);
+            tracked->second.linger_timer = 0;
+            tracked->second.state = session_state::running;
+            metrics_increment(metrics_counter::linger_resumes);
+        } else if (tracked->second.state == session_state::frozen) {
+            thaw_session(tracked->second, "Logged back in");
+        } else {
+            log_error(uid) << "There is already a tracked session for this user!";
+        }
+        return;
+    }
+
+    if (activation_waiting(uid)) {
+        log_debug(uid) << "Already listening on their sockets";
+        return;
+    }
+    if (is_restart_pending(uid)) {
+        // Their dinit is restarted once the backoff has passed, which a rescan must not cut short
+        log_debug(uid) << "Waiting to restart their dinit";
+        return;
+    }
+
+    // Carries on in handle_passwd, once the lookup has resolved, which may be straight away if it is cached
+    resolving.insert({uid, std::chrono::steady_clock::now()});
+    passwd_lookup(uid);
+}
+
+void handle_passwd(int uid, std::optional<user_entry> user) {
+    auto resolved = resolving.extract(uid);
+    if (resolved.empty()) {
+        return;
+    }
+    auto handling_start = resolved.mapped();
+    auto passwd_done = std::chrono::steady_clock::now();
+    metrics_observe(spawn_phase::passwd_lookup, passwd_done - handling_start);
+    if (pending_logouts.erase(uid) > 0) {
+        log_info(uid) << "Logged out before their passwd entry was resolved, not spawning";
+        activation_cancel(uid);
+        return;
+    }
+
+    // Check UID is valid
+    if (!user.has_value()) {
+        log_error(uid) << "UID is invalid!";
+        metrics_increment(metrics_counter::spawn_failures);
+        activation_cancel(uid);
+        return;
+    }
+
+    // Confirm there is no dinit process running. Note this is hardcoded to dinit as the binary option is meant to simply 
+    // specify where the dinit binary is - not meant to be something beyond dinit.
+    std::optional<pid_t> existing = process_index_find(uid);
+    auto check_done = std::chrono::steady_clock::now();
+    metrics_observe(spawn_phase::instance_check, check_done - passwd_done);
+    if (existing.has_value()) {
+        log_error(uid, existing.value()) << "There was already a dinit process running!";
+        activation_cancel(uid);
+        return;
+    }
+
+    // This is something that needs the upmost scrutiny - the program is still root here yet we parse their configuration.
+    // Since we do not act on user input directly until we drop privileges this is fine, but still be very wary when extending this.
+    std::string home = user->home; // The home directory
+    bool config_exists = false;
+    std::optional<configuration> user_config = load_user_config(uid, home, config_exists);
+
+    if (config_exists) {
+        if (!user_config.has_value()) {
+            // Their config had errors in it, give them a new one
+            log_error(uid) << "User's configuration was not valid! Giving them an empty one!";
+            user_config = configuration {};
+        }
+    } else {
+        // Their config never existed, we'll give them a new one
+        log_info(uid) << "User's configuration path did not exist! Some paths or files did not exist! Giving them an empty config!";
+        user_config = configuration {};
+    }
+    metrics_observe(spawn_phase::config_load, std::chrono::steady_clock::now() - check_done);
+
+    // Carries on in spawn_user once it has been generated, as dinit needs the boot service to be in place
+    if (!config_exists) {
+        log_info(uid) << "We previously determined the user's configuration path was not fully enstated, therefore we now regenerate any missing pieces!";
+        if (generate_config_as_user(user.value(), generate_config_option, user_config.value(), handling_start)) {
+            return;
+        }
+    } else if (user_config->ready_timeout > 0 && !check_ready_service_exists(home)) {
+        log_info(uid) << "Adding the service which reports once their boot service has started";
+        if (generate_config_as_user(user.value(), generate_ready_service_option, user_config.value(), handling_start)) {
+            return;
+        }
+    }
+    spawn_user(uid, user.value(), user_config.value(), handling_start);
+}
+
+void handle_spawned(int uid, std::optional<spawned_process> spawned) {
+    auto pending = pending_spawns.extract(uid);
+    bool logged_out = pending_logouts.erase(uid) > 0;
+
+    if (!spawned.has_value()) {
+        if (!pending.empty()) {
+            close_ready_fifo(uid, pending.mapped().ready_fd);
+        }
+        if (!spawn_helper_running() && !logged_out) {
+            // The helper went away with this request in flight, so start again without it
+            handle_user(uid);
+        } else {
+            log_error(uid) << "Spawn helper failed to spawn dinit!";
+            metrics_increment(metrics_counter::spawn_failures);
+            if (!pending.empty() && pending.mapped().in_cgroup) {
+                cgroup_release(uid);
+            }
+        }
+        return;
+    }
+    log_info(uid, spawned->pid) << "Spawned by the spawn helper";
+    if (pending.empty()) {
+        close(spawned->pidfd);
+        return;
+    }
+    record_spawn_timings(spawned->timings, pending.mapped().handling_start);
+    track_session(uid, spawned->pid, spawned->pidfd, pending.mapped().config, pending.mapped().in_cgroup, pending.mapped().ready_fd);
+    sessions.at(uid).reaped_by_helper = true;
+
+    if (logged_out) {
+        handle_logout(uid);
+    }
+}
+
+void handle_logout(int uid) {
+    if (is_restart_pending(uid)) {
+        log_info(uid) << "Logged out whilst waiting to restart their dinit";
+        loop_cancel(restarts.at(uid).timer);
+        restarts.erase(uid);
+        return;
+    }
+    if (activation_waiting(uid)) {
+        log_info(uid) << "Logged out without connecting to their sockets";
+        activation_cancel(uid);
+        return;
+    }
+    if (is_spawn_pending(uid)) {
+        log_info(uid) << "Logged out whilst being spawned, cleaning up once spawned";
+        pending_logouts.insert(uid);
+        return;
+    }
+    auto it = sessions.find(uid);
+    if (it == sessions.end()) {
+        log_error(uid) << "Tried to clean up, but failed to find matching PID!";
+        return;
+    }
+    if (it->second.state == session_state::lingering) {
+        // Already waiting out the linger window, such as when a rescan finds them still logged out
+        return;
+    }
+    it->second.respawn_on_exit = false;
+    if (it->second.state == session_state::frozen) {
+        thaw_session(it->second, "Logged out"); // So that it lingers, or is stopped, like any other session
+    }
+    if (it->second.state != session_state::running || it->second.config.linger == 0) {
+        stop_session(uid);
+        return;
+    }
+    log_info(uid) << "Logged out, stopping their dinit in " << it->second.config.linger << "s unless they log back in";
+    it->second.state = session_state::lingering;
+    it->second.linger_timer = loop_schedule(std::chrono::seconds(it->second.config.linger), [uid] {
+        auto lingering = sessions.find(uid);
+        if (lingering != sessions.end()) {
+            lingering->second.linger_timer = 0;
+            stop_session(uid);
+        }
+    });
+}
+
+void handle_idle(int uid) {
+    auto it = sessions.find(uid);
+    if (it == sessions.end() || it->second.state != session_state::running) {
+        return;
+    }
+    if (!cgroup_freeze(uid, true)) {
+        log_error(uid, it->second.pid) << "Failed to freeze their cgroup: " << std::strerror(errno);
+        return;
+    }
+    it->second.state = session_state::frozen;
+    metrics_increment(metrics_counter::freezes);
+    log_info(uid, it->second.pid) << "Idle for over " << it->second.config.freeze_after << "s, froze their dinit";
+}
+
+void handle_activity(int uid) {
+    auto it = sessions.find(uid);
+    if (it != sessions.end() && it->second.state == session_state::frozen) {
+        thaw_session(it->second, "Activity in their runtime directory");
+    }
+}
+
+void stop_session(int uid) {
+    if (is_restart_pending(uid)) {
+        log_info(uid) << "Cancelled restarting their dinit";
+        loop_cancel(restarts.at(uid).timer);
+        restarts.erase(uid);
+        return;
+    }
+    if (activation_waiting(uid)) {
+        log_info(uid) << "Closed their sockets without spawning their dinit";
+        activation_cancel(uid);
+        return;
+    }
+    if (is_spawn_pending(uid)) {
+        handle_logout(uid);
+        return;
+    }
+    auto it = sessions.find(uid);
+    if (it == sessions.end()) {
+        log_error(uid) << "Tried to clean up, but failed to find matching PID!";
+        return;
+    }
+    it->second.respawn_on_exit = false;
+    if (it->second.state == session_state::stopping) {
+        log_info(uid) << "Already stopping";
+        return;
+    }
+    loop_cancel(it->second.linger_timer);
+    it->second.linger_timer = 0;
+    if (it->second.state == session_state::frozen) {
+        thaw_session(it->second, "Stopping"); // Otherwise SIGTERM waits on it being thawed
+    }
+
+    if (pidfd_send_signal(it->second.pidfd, SIGTERM, nullptr, 0) == -1) {
+        log_error(uid, it->second.pid) << "pidfd_send_signal failed: " << std::strerror(errno);
+    } else {
+        metrics_increment(metrics_counter::kills);
+    }
+    it->second.stop_time = std::chrono::steady_clock::now();
+    it->second.state = session_state::stopping;
+    it->second.stop_timer = loop_schedule(std::chrono::seconds(it->second.config.stop_timeout), [uid] { escalate_stop(uid); });
+    log_info(uid) << "Cleaning up";
+}
+
+void handle_reaped(pid_t pid, std::optional<int> status) {
+    process_index_remove(pid);
+    auto generator = std::find_if(generating.begin(), generating.end(), [pid](const auto& entry) { return entry.second.pid == pid; });
+    if (generator != generating.end()) {
+        generation_finished(generator->first, status);
+        return;
+    }
+
+    auto uid_it = pid_uids.find(pid);
+    if (uid_it == pid_uids.end()) {
+        return;
+    }
+    int uid = uid_it->second;
+    metrics_increment(metrics_counter::reaps);
+    if (!status.has_value()) {
+        log_info(uid, pid) << "dinit process exited";
+    } else if (WIFSIGNALED(status.value())) {
+        log_info(uid, pid) << "dinit process was killed by signal " << WTERMSIG(status.value());
+    } else {
+        log_info(uid, pid) << "dinit process exited with code " << WEXITSTATUS(status.value());
+    }
+    auto it = sessions.find(uid);
+    if (it->second.stop_time.has_value()) {
+        metrics_observe(spawn_phase::session_stop, std::chrono::steady_clock::now() - it->second.stop_time.value());
+    }
+    bool respawn = it->second.respawn_on_exit;
+    // A clean exit was asked for, such as through dinitctl shutdown. Without a status, such as for an adopted session,
+    // there is no telling, so it is not restarted.
+    bool crashed = status.has_value() && (!WIFEXITED(status.value()) || WEXITSTATUS(status.value()) != 0);
+    std::error_code error;
+    bool logged_in = (it->second.state == session_state::running || it->second.state == session_state::frozen)
+        && std::filesystem::is_directory(options.monitored_path / std::to_string(uid), error);
+    configuration config = it->second.config;
+    auto ran_for = std::chrono::steady_clock::now() - it->second.start_time;
+    untrack_session(it);
+
+    if (respawn) {
+        restarts.erase(uid);
+        handle_user(uid);
+    } else if (crashed && logged_in) {
+        schedule_restart(uid, config, ran_for);
+    } else {
+        restarts.erase(uid);
+    }
+}
+
+void respawn_user(int uid) {
+    auto it = sessions.find(uid);
+    if (it == sessions.end()) {
+        if (is_restart_pending(uid)) {
+            // Straight away, rather than waiting out the backoff
+            loop_cancel(restarts.at(uid).timer);
+            restarts.at(uid).timer = 0;
+        }
+        if (!is_spawn_pending(uid)) {
+            handle_user(uid);
+        }
+        return;
+    }
+    log_info(uid) << "Respawning";
+    stop_session(uid);
+    it->second.respawn_on_exit = true;
+}
+
+void sessions_persist_to(const std::filesystem::path& path) {
+    state_file_persist_to(session_state_file, path);
+}
+
+void adopt_sessions(const std::filesystem::path& path) {
+    // It decides which processes we signal
+    if (!state_file_trusted(path, "session state")) {
+        return;
+    }
+
+    std::ifstream in(path);
+    int uid;
+    pid_t pid;
+    unsigned long long start_time;
+    while (in >> uid >> pid >> start_time) {
+        // The PID may have been recycled whilst we were down, so it must still be the very same process, owned by
+        // the same user. Checking again once the pidfd is open closes the window for it exiting in between.
+        if (sessions.contains(uid) || process_start_time(pid) != start_time || start_time == 0) {
+            continue;
+        }
+        int pidfd = pidfd_open(pid, 0);
+        if (pidfd == -1) {
+            continue;
+        }
+        struct stat process_info;
+        std::string proc_path = "/proc/" + std::to_string(pid);
+        if (process_start_time(pid) != start_time || stat(proc_path.c_str(), &process_info) != 0 || (int)process_info.st_uid != uid) {
+            close(pidfd);
+            continue;
+        }
+
+        track_session(uid, pid, pidfd, lookup_config(uid), cgroups_enabled() && cgroup_adopt(uid, pid), -1);
+        session& adopted = sessions.at(uid);
+        adopted.adopted = true;
+        if (adopted.in_cgroup) {
+            cgroup_freeze(uid, false); // We may have gone down with it frozen
+        }
+
+        // The start time is in clock ticks since boot, so work out how long ago that was
+        timespec boot_time;
+        clock_gettime(CLOCK_BOOTTIME, &boot_time);
+        double age = boot_time.tv_sec + boot_time.tv_nsec / 1e9 - (double)start_time / sysconf(_SC_CLK_TCK);
+        if (age > 0) {
+            adopted.start_time -= std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(age));
+        }
+        log_info(uid, pid) << "Adopted their dinit process, which survived a restart";
+    }
+}
+
+bool is_spawn_pending(int uid) {
+    return resolving.contains(uid) || generating.contains(uid) || pending_spawns.contains(uid);
+}
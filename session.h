@@ -0,0 +1,87 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <sys/types.h>
+#include "config.h"
+#include "loop.h"
+#include "passwd_cache.h"
+#include "spawn.h"
+
+enum class session_state {
+    running,
+    lingering, // Logged out, but kept until the linger window has passed
+    frozen, // Idle past its freeze_after, so its cgroup is frozen until there is activity
+    stopping, // Signalled to stop, waiting for it to exit
+};
+
+const char* session_state_name(session_state state);
+
+// Whether the user's boot service has started, which is only waited on for sessions with a ready_timeout. It is reported
+// by the ready_service from config.h, through a fifo in their runtime directory.
+enum class session_readiness {
+    not_requested,
+    waiting,
+    ready,
+    failed, // Exited or passed its ready_timeout first
+};
+
+const char* session_readiness_name(session_readiness readiness);
+
+// A user dinit instance spawned by us. The pidfd is what the session is tracked and signalled through, so a
+// recycled PID can never be mistaken for the user's dinit.
+struct session {
+    int uid;
+    pid_t pid;
+    int pidfd;
+    std::chrono::steady_clock::time_point start_time;
+    std::optional<std::chrono::steady_clock::time_point> stop_time; // Set once the user has logged out
+    session_state state;
+    bool respawn_on_exit; // Spawn a fresh instance once this one has exited
+    configuration config; // The user's configuration it was spawned with
+    timer_id stop_timer; // Escalates to SIGKILL once the stop_timeout has passed
+    timer_id linger_timer; // Stops the session once the linger window has passed
+    session_readiness readiness;
+    int ready_fd; // The fifo the ready_service writes to, whilst waiting on it, otherwise -1
+    timer_id ready_timer; // Gives up waiting once the ready_timeout has passed
+    std::optional<std::chrono::steady_clock::duration> time_to_ready; // From being exec'd, once boot started
+    unsigned long long proc_start_time; // From /proc, to recognise the process again after a daemon restart
+    bool adopted; // Survived a daemon restart, so it is not our child
+    bool reaped_by_helper; // Spawned by the spawn helper, which sends back its exit status
+    timer_id status_timer; // Once it has exited, gives up waiting for the helper's exit status
+    bool in_cgroup; // Placed in a cgroup of its own, see cgroup.h
+};
+
+// Supervision of a user's dinit which crashed whilst they were still logged in. Kept whilst its restart is waited on,
+// and whilst the restarted dinit runs, so that crashes in a row back off further.
+struct restart_backoff {
+    int crashes; // In a row, without running for restart_stable_after in between
+    timer_id timer; // Set whilst waiting to restart
+    std::chrono::steady_clock::time_point due;
+};
+
+const std::chrono::seconds restart_stable_after{60};
+const std::chrono::seconds max_restart_backoff{300};
+
+const std::map<int, session>& get_sessions();
+const std::map<int, restart_backoff>& get_restarts();
+bool is_restart_pending(int uid);
+void handle_user(int uid);
+void handle_passwd(int uid, std::optional<user_entry> user);
+void handle_spawned(int uid, std::optional<spawned_process> spawned);
+void handle_logout(int uid);
+// From idle.h, for sessions with a freeze_after
+void handle_idle(int uid);
+void handle_activity(int uid);
+void stop_session(int uid); // Like handle_logout, but without waiting out the linger window
+void respawn_user(int uid);
+bool is_spawn_pending(int uid);
+
+// Tracked sessions are recorded in a state file, so that a restarted daemon can adopt the user dinit processes which
+// survived it rather than refusing to manage them. Adoption must happen before any users are handled.
+void sessions_persist_to(const std::filesystem::path& path);
+void adopt_sessions(const std::filesystem::path& path);
+void handle_reaped(pid_t pid, std::optional<int> status);
@@ -0,0 +1,188 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "spawn.h"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log.h"
+
+namespace {
+
+// The child shares our memory (CLONE_VM) and we are suspended until it execs (CLONE_VFORK), so it can report
+// how far it got through here. It must stick to raw syscalls: libc's set*id wrappers would try to synchronise
+// credentials with the threads of the process whose memory it is borrowing.
+struct spawn_context {
+    const spawn_request* request;
+    char* const* argv;
+    char* const* envp;
+    int cgroup_procs_fd; // -1 if not moving into a cgroup
+    int passed_fds[max_passed_fds]; // The listen fds
+    size_t passed_fd_count;
+    char listen_pid[32]; // LISTEN_PID=, completed by the child as only it knows its PID
+    const char* failed_step;
+    int error;
+    std::chrono::steady_clock::time_point child_started;
+    std::chrono::steady_clock::time_point privileges_dropped;
+};
+
+const size_t child_stack_size = 64 * 1024;
+const char listen_pid_prefix[] = "LISTEN_PID=";
+
+void fill_listen_pid(char* variable) {
+    pid_t pid = (pid_t)syscall(SYS_getpid);
+    char digits[16];
+    size_t count = 0;
+    do {
+        digits[count++] = (char)('0' + pid % 10);
+        pid /= 10;
+    } while (pid > 0);
+    char* out = variable + sizeof(listen_pid_prefix) - 1;
+    while (count > 0) {
+        *out++ = digits[--count];
+    }
+    *out = '\0';
+}
+
+// Moves the passed fds into place without O_CLOEXEC, so that they survive the execve. Each is first copied out of the
+// way, as one may already occupy another's place, and those copies are closed by the execve.
+bool place_passed_fds(const spawn_context* context) {
+    int temporary[max_passed_fds];
+    int clear_of = first_passed_fd + (int)context->passed_fd_count;
+    for (size_t i = 0; i < context->passed_fd_count; i++) {
+        temporary[i] = (int)syscall(SYS_fcntl, context->passed_fds[i], F_DUPFD_CLOEXEC, clear_of);
+        if (temporary[i] == -1) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < context->passed_fd_count; i++) {
+        if (syscall(SYS_dup3, temporary[i], first_passed_fd + (int)i, 0) == -1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int spawn_child(void* arg) {
+    spawn_context* context = static_cast<spawn_context*>(arg);
+    const spawn_request* request = context->request;
+    context->child_started = std::chrono::steady_clock::now();
+
+    // Done first, whilst still root, so that everything the child goes on to start is accounted to the user's cgroup.
+    // Writing 0 moves the writer itself.
+    if (context->cgroup_procs_fd != -1 && write(context->cgroup_procs_fd, "0", 1) != 1) {
+        context->failed_step = "cgroup placement";
+    } else if (syscall(SYS_setgroups, request->groups.size(), request->groups.data()) != 0) {
+        context->failed_step = "setgroups";
+    } else if (syscall(SYS_setgid, request->gid) != 0) {
+        context->failed_step = "setgid";
+    } else if (syscall(SYS_setuid, request->uid) != 0) {
+        context->failed_step = "setuid";
+    } else if (geteuid() != request->uid || getegid() != request->gid) {
+        // Check we have fully swapped, to prevent privilege escalation issues
+        context->failed_step = "drop privileges";
+    } else if (!place_passed_fds(context)) {
+        context->failed_step = "passing fds";
+    } else {
+        if (!request->listen_fds.empty()) {
+            fill_listen_pid(context->listen_pid);
+        }
+
+        // The daemon blocks signals to receive them through a signalfd, and the signal mask survives execve
+        sigset_t empty_mask;
+        sigemptyset(&empty_mask);
+        syscall(SYS_rt_sigprocmask, SIG_SETMASK, &empty_mask, nullptr, _NSIG / 8);
+
+        context->privileges_dropped = std::chrono::steady_clock::now();
+        execve(request->program.c_str(), context->argv, context->envp);
+        context->failed_step = "execve";
+    }
+    context->error = errno;
+    _exit(127);
+}
+
+} // namespace
+
+std::optional<spawned_process> spawn_process(const spawn_request& request) {
+    // Only one child can be borrowing it at a time, as we stay suspended until it has exec'd
+    static void* child_stack = nullptr;
+    if (child_stack == nullptr) {
+        child_stack = mmap(nullptr, child_stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+        if (child_stack == MAP_FAILED) {
+            child_stack = nullptr;
+            log_error() << "Failed to allocate the spawn stack: " << std::strerror(errno);
+            return std::nullopt;
+        }
+    }
+
+    std::vector<char*> argv;
+    for (const std::string& argument : request.arguments) {
+        argv.push_back(const_cast<char*>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    if (request.listen_fds.size() > max_passed_fds) {
+        log_error(request.uid) << "Too many fds to pass: " << request.listen_fds.size();
+        return std::nullopt;
+    }
+    spawn_context context = {};
+    context.request = &request;
+    context.argv = argv.data();
+    memcpy(context.listen_pid, listen_pid_prefix, sizeof(listen_pid_prefix));
+
+    std::vector<char*> envp;
+    for (const std::string& variable : request.environment) {
+        envp.push_back(const_cast<char*>(variable.c_str()));
+    }
+    if (!request.listen_fds.empty()) {
+        envp.push_back(context.listen_pid);
+    }
+    envp.push_back(nullptr);
+    context.envp = envp.data();
+
+    int cgroup_procs_fd = -1;
+    if (!request.cgroup_procs.empty()) {
+        cgroup_procs_fd = open(request.cgroup_procs.c_str(), O_WRONLY | O_CLOEXEC);
+        if (cgroup_procs_fd == -1) {
+            log_error(request.uid) << "Failed to open " << request.cgroup_procs << ": " << std::strerror(errno);
+            return std::nullopt;
+        }
+    }
+
+    context.cgroup_procs_fd = cgroup_procs_fd;
+    for (int fd : request.listen_fds) {
+        context.passed_fds[context.passed_fd_count++] = fd;
+    }
+    int pidfd = -1;
+    auto clone_start = std::chrono::steady_clock::now();
+    pid_t pid = clone(spawn_child, static_cast<char*>(child_stack) + child_stack_size,
+        CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD, &context, &pidfd);
+    if (cgroup_procs_fd != -1) {
+        close(cgroup_procs_fd);
+    }
+    if (pid == -1) {
+        log_error() << "clone failed: " << std::strerror(errno);
+        return std::nullopt;
+    }
+
+    if (context.failed_step != nullptr) {
+        log_error(request.uid) << context.failed_step << " failed: " << strerror(context.error);
+        waitpid(pid, nullptr, 0); // It has already exited
+        close(pidfd);
+        return std::nullopt;
+    }
+    // We are only resumed once the child has exec'd
+    auto exec_done = std::chrono::steady_clock::now();
+    spawn_timings timings = {
+        context.child_started - clone_start,
+        context.privileges_dropped - context.child_started,
+        exec_done - context.privileges_dropped,
+    };
+    return spawned_process {pid, pidfd, timings};
+}
@@ -0,0 +1,41 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// Everything needed to start a process as another user, resolved up front. The spawned child only drops
+// privileges and calls execve, so no configuration parsing or NSS lookups happen between clone and exec.
+struct spawn_request {
+    uid_t uid;
+    gid_t gid;
+    std::vector<gid_t> groups;
+    std::string program;
+    std::vector<std::string> arguments; // Including argv[0]
+    std::vector<std::string> environment; // KEY=value
+    std::string cgroup_procs; // cgroup.procs of the cgroup the child moves itself into, or empty to stay in ours
+    std::vector<int> listen_fds; // Passed to the child from first_passed_fd onwards, with LISTEN_PID set to match
+};
+
+// Where the child finds the fds passed to it, in the LISTEN_FDS convention
+const int first_passed_fd = 3;
+const size_t max_passed_fds = 32;
+
+// How long each step between clone and the new program running took
+struct spawn_timings {
+    std::chrono::steady_clock::duration fork;
+    std::chrono::steady_clock::duration privilege_drop;
+    std::chrono::steady_clock::duration exec;
+};
+
+struct spawned_process {
+    pid_t pid;
+    int pidfd;
+    spawn_timings timings;
+};
+
+// Returns nullopt if the child could not be created, or failed before reaching the new program
+std::optional<spawned_process> spawn_process(const spawn_request& request);
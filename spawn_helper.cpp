@@ -0,0 +1,391 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "spawn_helper.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "loop.h"
+
+namespace {
+
+// Requests are packed into batches of at most this many bytes, each sent as a single SOCK_SEQPACKET message
+const size_t max_message_size = 64 * 1024;
+
+enum class reply_kind : int32_t {
+    spawned, // In reply to a request
+    exited, // A child the helper spawned was reaped, sent whenever that happens
+};
+
+struct helper_reply {
+    reply_kind kind;
+    int32_t uid;
+    int32_t pid; // -1 if the spawn failed, otherwise a pidfd is attached
+    int32_t status; // The wait status, for exited
+    int64_t timings[3]; // Nanoseconds for each of spawn_timings
+};
+
+int helper_fd = -1;
+pid_t helper_pid = -1;
+spawn_helper_callback on_spawned;
+spawn_helper_exit_callback on_exited;
+
+std::string current_batch;
+uint32_t current_batch_count = 0;
+std::deque<std::string> outgoing;
+std::deque<int> in_flight; // UIDs in submission order, the helper replies in the same order
+
+// Serialisation of spawn_request
+
+void put_u32(std::string& out, uint32_t value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void put_string(std::string& out, const std::string& value) {
+    put_u32(out, value.size());
+    out.append(value);
+}
+
+void put_strings(std::string& out, const std::vector<std::string>& values) {
+    put_u32(out, values.size());
+    for (const std::string& value : values) {
+        put_string(out, value);
+    }
+}
+
+std::string encode_request(const spawn_request& request) {
+    std::string out;
+    put_u32(out, request.uid);
+    put_u32(out, request.gid);
+    put_u32(out, request.groups.size());
+    for (gid_t group : request.groups) {
+        put_u32(out, group);
+    }
+    put_string(out, request.program);
+    put_strings(out, request.arguments);
+    put_strings(out, request.environment);
+    put_string(out, request.cgroup_procs);
+    return out;
+}
+
+struct message_reader {
+    const char* position;
+    const char* end;
+    bool valid = true;
+
+    uint32_t u32() {
+        uint32_t value = 0;
+        if (end - position < (ptrdiff_t)sizeof(value)) {
+            valid = false;
+            return 0;
+        }
+        memcpy(&value, position, sizeof(value));
+        position += sizeof(value);
+        return value;
+    }
+
+    std::string string() {
+        uint32_t length = u32();
+        if (!valid || (size_t)(end - position) < length) {
+            valid = false;
+            return {};
+        }
+        std::string value(position, length);
+        position += length;
+        return value;
+    }
+
+    std::vector<std::string> strings() {
+        std::vector<std::string> values;
+        uint32_t count = u32();
+        for (uint32_t i = 0; i < count && valid; i++) {
+            values.push_back(string());
+        }
+        return values;
+    }
+
+    spawn_request request() {
+        spawn_request request = {};
+        request.uid = u32();
+        request.gid = u32();
+        uint32_t group_count = u32();
+        for (uint32_t i = 0; i < group_count && valid; i++) {
+            request.groups.push_back(u32());
+        }
+        request.program = string();
+        request.arguments = strings();
+        request.environment = strings();
+        request.cgroup_procs = string();
+        return request;
+    }
+};
+
+// Helper process side
+
+void helper_send_reply(int fd, int uid, std::optional<spawned_process> spawned) {
+    helper_reply reply = {reply_kind::spawned, uid, spawned.has_value() ? spawned->pid : -1, 0, {}};
+    if (spawned.has_value()) {
+        reply.timings[0] = std::chrono::nanoseconds(spawned->timings.fork).count();
+        reply.timings[1] = std::chrono::nanoseconds(spawned->timings.privilege_drop).count();
+        reply.timings[2] = std::chrono::nanoseconds(spawned->timings.exec).count();
+    }
+    iovec iov = {&reply, sizeof(reply)};
+    msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    if (spawned.has_value()) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &spawned->pidfd, sizeof(int));
+    }
+    while (sendmsg(fd, &message, MSG_NOSIGNAL) == -1 && errno == EINTR) {}
+
+    if (spawned.has_value()) {
+        close(spawned->pidfd); // The daemon has its own copy now
+    }
+}
+
+[[noreturn]] void helper_main(int fd) {
+    sigset_t signal_mask;
+    sigemptyset(&signal_mask);
+    sigaddset(&signal_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &signal_mask, nullptr);
+    int signal_fd = signalfd(-1, &signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        log_error() << "Spawn helper signalfd failed: " << std::strerror(errno);
+        _exit(EXIT_FAILURE);
+    }
+
+    std::vector<char> buffer(max_message_size);
+    pollfd fds[2] = {{fd, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            log_error() << "Spawn helper poll failed: " << std::strerror(errno);
+            _exit(EXIT_FAILURE);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {}
+            int status;
+            pid_t pid;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                log_debug(std::nullopt, pid) << "Spawn helper reaped child, status: " << status;
+                helper_reply reply = {reply_kind::exited, -1, pid, status, {}};
+                while (send(fd, &reply, sizeof(reply), MSG_NOSIGNAL) == -1 && errno == EINTR) {}
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t length = recv(fd, buffer.data(), buffer.size(), 0);
+            if (length == -1 && errno == EINTR) continue;
+            if (length <= 0) {
+                // The daemon has gone away, the dinit processes we started are left running as they would be for it
+                _exit(EXIT_SUCCESS);
+            }
+
+            message_reader reader = {buffer.data(), buffer.data() + length};
+            uint32_t count = reader.u32();
+            for (uint32_t i = 0; i < count && reader.valid; i++) {
+                spawn_request request = reader.request();
+                if (!reader.valid) {
+                    log_error() << "Spawn helper received a malformed request!";
+                    _exit(EXIT_FAILURE);
+                }
+                helper_send_reply(fd, request.uid, spawn_process(request));
+            }
+        }
+    }
+}
+
+// Daemon side
+
+void helper_stopped() {
+    log_error() << "Spawn helper stopped, spawning directly from now on!";
+    loop_remove(helper_fd);
+    close(helper_fd);
+    helper_fd = -1;
+    waitpid(helper_pid, nullptr, WNOHANG);
+
+    outgoing.clear();
+    current_batch.clear();
+    current_batch_count = 0;
+    std::deque<int> lost;
+    lost.swap(in_flight);
+    for (int uid : lost) {
+        on_spawned(uid, std::nullopt);
+    }
+}
+
+void helper_flush() {
+    if (current_batch_count > 0) {
+        std::string message;
+        put_u32(message, current_batch_count);
+        message += current_batch;
+        outgoing.push_back(std::move(message));
+        current_batch.clear();
+        current_batch_count = 0;
+    }
+
+    while (!outgoing.empty()) {
+        if (send(helper_fd, outgoing.front().data(), outgoing.front().size(), MSG_DONTWAIT | MSG_NOSIGNAL) == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                loop_modify(helper_fd, EPOLLIN | EPOLLOUT); // Resume once the helper has caught up
+                return;
+            }
+            log_error() << "Failed to send to spawn helper: " << std::strerror(errno);
+            helper_stopped();
+            return;
+        }
+        outgoing.pop_front();
+    }
+    loop_modify(helper_fd, EPOLLIN);
+}
+
+void helper_receive() {
+    while (true) {
+        helper_reply reply = {};
+        iovec iov = {&reply, sizeof(reply)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr message = {};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t length = recvmsg(helper_fd, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (length == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) {
+                helper_stopped();
+            }
+            return;
+        }
+        if (length == 0) {
+            helper_stopped();
+            return;
+        }
+
+        if (reply.kind == reply_kind::exited) {
+            on_exited(reply.pid, reply.status);
+            continue;
+        }
+
+        int pidfd = -1;
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        if (header != nullptr && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            memcpy(&pidfd, CMSG_DATA(header), sizeof(int));
+        }
+        if (in_flight.empty() || in_flight.front() != reply.uid) {
+            log_error(reply.uid) << "Spawn helper replied for an unexpected UID";
+            if (pidfd != -1) { close(pidfd); }
+            continue;
+        }
+        in_flight.pop_front();
+
+        if (reply.pid > 0 && pidfd != -1) {
+            spawn_timings timings = {
+                std::chrono::nanoseconds(reply.timings[0]),
+                std::chrono::nanoseconds(reply.timings[1]),
+                std::chrono::nanoseconds(reply.timings[2]),
+            };
+            on_spawned(reply.uid, spawned_process {reply.pid, pidfd, timings});
+        } else {
+            if (pidfd != -1) { close(pidfd); }
+            on_spawned(reply.uid, std::nullopt);
+        }
+    }
+}
+
+} // namespace
+
+bool spawn_helper_start(spawn_helper_callback callback, spawn_helper_exit_callback exit_callback) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1) {
+        log_error() << "Failed to create the spawn helper socketpair: " << std::strerror(errno);
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        log_error() << "Failed to fork the spawn helper: " << std::strerror(errno);
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0) {
+        log_forked();
+        // Keep nothing of the daemon's beyond the standard streams and our end of the socketpair
+        dup2(fds[1], 3);
+        close_range(4, ~0U, 0);
+        helper_main(3);
+    }
+    close(fds[1]);
+
+    helper_fd = fds[0];
+    helper_pid = pid;
+    on_spawned = std::move(callback);
+    on_exited = std::move(exit_callback);
+    loop_add(helper_fd, EPOLLIN, [](uint32_t events) {
+        if (events & EPOLLOUT) {
+            helper_flush();
+        }
+        if (helper_fd != -1 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+            helper_receive();
+        }
+    });
+    log_info(std::nullopt, pid) << "Started spawn helper";
+    return true;
+}
+
+bool spawn_helper_running() {
+    return helper_fd != -1;
+}
+
+void spawn_helper_submit(int uid, const spawn_request& request) {
+    std::string encoded = encode_request(request);
+    if (encoded.size() + sizeof(uint32_t) > max_message_size) {
+        log_error(uid) << "Spawn request is too large for the spawn helper!";
+        on_spawned(uid, std::nullopt);
+        return;
+    }
+    if (current_batch.size() + encoded.size() + sizeof(uint32_t) > max_message_size) {
+        helper_flush();
+        if (helper_fd == -1) {
+            on_spawned(uid, std::nullopt);
+            return;
+        }
+    }
+
+    bool first_in_batch = current_batch_count == 0;
+    current_batch += encoded;
+    current_batch_count++;
+    in_flight.push_back(uid);
+    if (first_in_batch) {
+        loop_defer([] {
+            if (helper_fd != -1) {
+                helper_flush();
+            }
+        });
+    }
+}
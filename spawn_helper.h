@@ -0,0 +1,17 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <functional>
+#include <optional>
+#include "spawn.h"
+
+// Optional pre-forked helper process that performs spawns on behalf of the daemon. Requests are queued and sent over
+// a socketpair in one batch per loop iteration, so the event loop never waits on a spawn. Replies carry a pidfd for
+// the new process, and the helper (its parent) takes care of reaping it, sending back the wait status it was reaped with.
+using spawn_helper_callback = std::function<void(int uid, std::optional<spawned_process> spawned)>;
+using spawn_helper_exit_callback = std::function<void(pid_t pid, int status)>;
+
+// Must be called before the daemon sets up anything the helper should not inherit
+bool spawn_helper_start(spawn_helper_callback callback, spawn_helper_exit_callback exit_callback);
+bool spawn_helper_running();
+void spawn_helper_submit(int uid, const spawn_request& request);
@@ -0,0 +1,94 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+// dinit-user-spawnctl, a small client for the dinit-user-spawn control socket. See control.h for the commands.
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [--socket <path>] <command>\n"
+        << "Commands:\n"
+        << "  list              List tracked user sessions\n"
+        << "  respawn <uid>     Stop the user's dinit if running, then spawn a fresh one\n"
+        << "  stop <uid>        Stop the user's dinit\n"
+        << "  reconcile         Bring the tracked sessions in line with the monitored path\n"
+        << "  reload            Reload user configurations and passwd entries on their next spawn" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::filesystem::path socket_path = default_control_socket;
+    std::string command;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc && command.empty()) {
+            socket_path = argv[++i];
+        } else if (arg == "--help") {
+            print_usage(argv[0]);
+            return EXIT_SUCCESS;
+        } else {
+            command += command.empty() ? arg : " " + arg;
+        }
+    }
+    if (command.empty()) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.string().size() >= sizeof(address.sun_path)) {
+        std::cerr << "[ERROR] Socket path is too long: " << socket_path.string() << std::endl;
+        return EXIT_FAILURE;
+    }
+    socket_path.string().copy(address.sun_path, sizeof(address.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+        std::cerr << "[ERROR] Failed to connect to " << socket_path.string() << ": " << strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    command += '\n';
+    for (size_t written = 0; written < command.size(); ) {
+        ssize_t length = write(fd, command.data() + written, command.size() - written);
+        if (length == -1) {
+            if (errno == EINTR) continue;
+            std::cerr << "[ERROR] Failed to send command: " << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        written += length;
+    }
+
+    std::string response;
+    char buffer[4096];
+    while (true) {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length == -1) {
+            if (errno == EINTR) continue;
+            std::cerr << "[ERROR] Failed to read response: " << strerror(errno) << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (length == 0) {
+            break;
+        }
+        response.append(buffer, length);
+    }
+    close(fd);
+
+    size_t newline = response.find('\n');
+    std::string status = response.substr(0, newline);
+    if (status != "OK") {
+        std::cerr << "[ERROR] " << (status.starts_with("ERROR ") ? status.substr(6) : "Malformed response from daemon") << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << response.substr(newline + 1);
+    return EXIT_SUCCESS;
+}
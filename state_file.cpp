@@ -0,0 +1,82 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#include "state_file.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "loop.h"
+
+namespace {
+
+// Written beside it and renamed over it, so that a reader never sees it half written. It is created 0600, so that its
+// contents are never readable by others, not even before the rename.
+void write_now(state_file& file) {
+    file.write_scheduled = false;
+    std::filesystem::path temporary = file.path;
+    temporary += ".tmp";
+
+    std::ostringstream out;
+    file.write(out);
+    std::string contents = out.str();
+
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        log_error() << "Failed to write " << file.description << ": " << temporary.string() << ": " << std::strerror(errno);
+        return;
+    }
+    // An existing temporary file keeps its mode through O_CREAT, so it is set again
+    bool written = fchmod(fd, 0600) == 0;
+    for (size_t offset = 0; written && offset < contents.size();) {
+        ssize_t length = write(fd, contents.data() + offset, contents.size() - offset);
+        if (length == -1 && errno == EINTR) continue;
+        written = length > 0;
+        offset += written ? (size_t)length : 0;
+    }
+    if (close(fd) != 0 || !written || rename(temporary.c_str(), file.path.c_str()) != 0) {
+        log_error() << "Failed to write " << file.description << ": " << file.path.string();
+    }
+}
+
+} // namespace
+
+bool state_file_persist_to(state_file& file, const std::filesystem::path& path) {
+    std::error_code error;
+    std::filesystem::create_directories(path.parent_path(), error);
+    if (error) {
+        log_error() << "Failed to create " << path.parent_path().string() << ": " << error.message();
+        return false;
+    }
+    file.path = path;
+    state_file_schedule_write(file);
+    return true;
+}
+
+void state_file_schedule_write(state_file& file) {
+    if (file.path.empty() || file.write_scheduled) {
+        return;
+    }
+    file.write_scheduled = true;
+    loop_defer([&file] { write_now(file); });
+}
+
+bool state_file_trusted(const std::filesystem::path& path, const char* description) {
+    int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        return false; // Nothing persisted yet
+    }
+    struct stat info;
+    struct stat parent_info;
+    bool trusted = fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_uid == 0 && (info.st_mode & 022) == 0
+        && stat(path.parent_path().c_str(), &parent_info) == 0 && parent_info.st_uid == 0 && (parent_info.st_mode & 022) == 0;
+    close(fd);
+    if (!trusted) {
+        log_error() << "Ignoring " << description << ' ' << path.string() << ", it is not exclusively writable by root!";
+    }
+    return trusted;
+}
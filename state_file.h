@@ -0,0 +1,26 @@
+// Copyright (C) 2025 initMayday (initMayday@protonmail.com). This is available under AGPLv3-or-later. See LICENSE
+
+#pragma once
+#include <filesystem>
+#include <functional>
+#include <ostream>
+
+// Files the daemon persists across restarts, such as the config cache and the session state. They are read back as
+// root and decide what is exec'd or signalled, so they are written atomically, readable only by root, and only trusted
+// if nobody else could have written them.
+
+struct state_file {
+    const char* description; // For log messages, such as "config cache"
+    std::function<void(std::ostream& out)> write; // Writes the whole contents
+    std::filesystem::path path; // Empty until persisting is enabled
+    bool write_scheduled = false;
+};
+
+// Creates the file's directory and writes it out for the first time
+bool state_file_persist_to(state_file& file, const std::filesystem::path& path);
+// Writes are batched, so a burst of logins results in one write. The file must outlive the event loop.
+void state_file_schedule_write(state_file& file);
+
+// Whether path is a regular file which only root could have written, or replaced through its directory. Returns false
+// without logging if it does not exist.
+bool state_file_trusted(const std::filesystem::path& path, const char* description);